@@ -1,45 +1,212 @@
 /* This driver runs the probes and lists the USB device properties */
 #include <linux/module.h>
 #include <linux/usb.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <asm/unaligned.h>
 
-/* Sandisk Cruzer Data Flash Identification Codes */
-#define VENDOR_ID 0x0781
-#define DEVICE_ID 0x5567
+/* Vendor Identification Codes */
+#define VENDOR_ID_SANDISK  0x0781
+#define VENDOR_ID_KINGSTON 0x0951
+#define VENDOR_ID_SAMSUNG  0x090c
+
+/* Device Identification Codes */
+#define DEVICE_ID_CRUZER_BLADE 0x5567
+#define DEVICE_ID_ULTRA        0x5581
+#define DEVICE_ID_ULTRA_FIT    0x5583
+#define DEVICE_ID_DT_30        0x1666
+#define DEVICE_ID_BAR_PLUS     0x1000
+
+/* Layout of the descriptors file, all fields little endian :
+   Header  : magic "USBS", version, no of records, total length in bytes
+   Records : type, reserved byte, length of the data, data */
+#define SNAPSHOT_MAGIC   0x53425355
+#define SNAPSHOT_VERSION 1
+
+/* Record types */
+/* Bus number, device number, speed and interface number, one byte each */
+#define SNAPSHOT_LOCATION     1
+/* Device descriptor as read at enumeration */
+#define SNAPSHOT_DEVICE       2
+/* Active configuration with all its interface and endpoint descriptors */
+#define SNAPSHOT_CONFIG       3
+/* Strings in UTF-8 without the terminating NUL, absent when the device has none */
+#define SNAPSHOT_MANUFACTURER 4
+#define SNAPSHOT_PRODUCT      5
+#define SNAPSHOT_SERIAL       6
+#define SNAPSHOT_INTERFACE    7
+
+struct snapshot_hdr
+{
+  __le32 magic;
+  __u8   version;
+  __u8   nr_records;
+  __le16 length;
+} __packed;
+
+struct snapshot_record
+{
+  __u8   type;
+  __u8   resv;
+  __le16 length;
+} __packed;
+
+/* Private Structure */
+struct driver_private
+{
+  /* Descriptor snapshot taken at probe and its size */
+  u8 *snapshot;
+  size_t snapshot_len;
+};
+
+/* Append one record to the snapshot, or only count its size when buf is NULL */
+static size_t snapshot_add(u8 *buf, size_t pos, u8 type, const void *data, size_t len)
+{
+  struct snapshot_record *rec;
+
+  if(!data)
+    return pos;
+  if(buf)
+  {
+    rec = (struct snapshot_record *)(buf + pos);
+    rec->type = type;
+    rec->resv = 0;
+    put_unaligned_le16(len, &rec->length);
+    memcpy(buf + pos + sizeof(*rec), data, len);
+    ((struct snapshot_hdr *)buf)->nr_records++;
+  }
+  return pos + sizeof(*rec) + len;
+}
+
+/* Lay out every record after the header, returns the total size */
+static size_t snapshot_build(struct usb_interface *intf, u8 *buf)
+{
+  struct usb_device *dev = interface_to_usbdev(intf);
+  const char *intf_string = intf->cur_altsetting->string;
+  const void *config = NULL;
+  size_t config_len = 0;
+  u8 location[4];
+  size_t pos = sizeof(struct snapshot_hdr);
+  int ii;
+
+  location[0] = dev->bus->busnum;
+  location[1] = dev->devnum;
+  location[2] = dev->speed;
+  location[3] = intf->cur_altsetting->desc.bInterfaceNumber;
+
+  /* usbcore keeps the raw configurations read at enumeration */
+  for(ii = 0; ii < dev->descriptor.bNumConfigurations; ii++)
+  {
+    if(dev->actconfig == &dev->config[ii] && dev->rawdescriptors && dev->rawdescriptors[ii])
+    {
+      config = dev->rawdescriptors[ii];
+      config_len = le16_to_cpu(dev->config[ii].desc.wTotalLength);
+    }
+  }
+
+  pos = snapshot_add(buf, pos, SNAPSHOT_LOCATION, location, sizeof(location));
+  pos = snapshot_add(buf, pos, SNAPSHOT_DEVICE, &dev->descriptor, sizeof(dev->descriptor));
+  pos = snapshot_add(buf, pos, SNAPSHOT_CONFIG, config, config_len);
+  pos = snapshot_add(buf, pos, SNAPSHOT_MANUFACTURER, dev->manufacturer, dev->manufacturer ? strlen(dev->manufacturer) : 0);
+  pos = snapshot_add(buf, pos, SNAPSHOT_PRODUCT, dev->product, dev->product ? strlen(dev->product) : 0);
+  pos = snapshot_add(buf, pos, SNAPSHOT_SERIAL, dev->serial, dev->serial ? strlen(dev->serial) : 0);
+  pos = snapshot_add(buf, pos, SNAPSHOT_INTERFACE, intf_string, intf_string ? strlen(intf_string) : 0);
+  return pos;
+}
+
+/* Path --> /sys/bus/usb/devices/<bus>-<port>:<config>.<interface>/descriptors_snapshot */
+static ssize_t descriptors_snapshot_read(struct file *file, struct kobject *kobj, struct bin_attribute *attr,
+                                         char *buf, loff_t off, size_t count)
+{
+  struct driver_private *priv = usb_get_intfdata(to_usb_interface(kobj_to_dev(kobj)));
+
+  if(!priv)
+    return -ENODEV;
+  return memory_read_from_buffer(buf, count, &off, priv->snapshot, priv->snapshot_len);
+}
+static BIN_ATTR_RO(descriptors_snapshot, 0);
+
+static struct bin_attribute *usb_probe_bin_attrs[] =
+{
+  &bin_attr_descriptors_snapshot,
+  NULL,
+};
+
+static const struct attribute_group usb_probe_group =
+{
+  .bin_attrs = usb_probe_bin_attrs,
+};
+
+static const struct attribute_group *usb_probe_groups[] =
+{
+  &usb_probe_group,
+  NULL,
+};
 
 static int usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
   /* Get the usb_device structure reference from the interface */
   /* This structure is the kernel's representation of a usb device */
   struct usb_device *dev = interface_to_usbdev(intf);
+  struct driver_private *priv;
+  struct snapshot_hdr *hdr;
 
   pr_info("Interface Driver : %s Invoked\r\n", __func__);
 
-  /* Access the fields of the usb device */
-  pr_info("Device Number   = %d\r\n",dev->devnum);  
-  pr_info("Device Speed    = %d\r\n",dev->speed);  
-  pr_info("Vendor ID       = 0x%4hX\r\n",dev->descriptor.idVendor);  
-  pr_info("Product ID      = 0x%4hX\r\n",dev->descriptor.idProduct);  
-  pr_info("Device BCD      = 0x%hX\r\n",dev->descriptor.bcdDevice);  
-  pr_info("Device Class    = 0x%hX\r\n",dev->descriptor.bDeviceClass);
-  pr_info("Device SubClass = 0x%hX\r\n",dev->descriptor.bDeviceSubClass);  
-  pr_info("Device Protocol = 0x%hX\r\n",dev->descriptor.bDeviceProtocol);  
-  pr_info("PacketSize      = %hu\r\n",dev->descriptor.bMaxPacketSize0);  
-  pr_info("Manufacturer    = %s\r\n",dev->manufacturer);
-  pr_info("Product         = %s\r\n",dev->product);
-  pr_info("Serial          = %s\r\n",dev->serial);
-  /* There are also separate iManufacturer, iProduct and iSerialNumber 
-     Fields inside the descriptor structure field of the usb_device structure */
+  priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+  if(NULL == priv)
+    return -ENOMEM;
+
+  /* Copy the descriptors and strings usbcore read at enumeration once, readers
+     of descriptors_snapshot never cause control transfers to the device */
+  priv->snapshot_len = snapshot_build(intf, NULL);
+  if(priv->snapshot_len > U16_MAX)
+  {
+    kfree(priv);
+    return -E2BIG;
+  }
+  priv->snapshot = kzalloc(priv->snapshot_len, GFP_KERNEL);
+  if(NULL == priv->snapshot)
+  {
+    kfree(priv);
+    return -ENOMEM;
+  }
+  hdr = (struct snapshot_hdr *)priv->snapshot;
+  hdr->magic = cpu_to_le32(SNAPSHOT_MAGIC);
+  hdr->version = SNAPSHOT_VERSION;
+  hdr->length = cpu_to_le16(priv->snapshot_len);
+  snapshot_build(intf, priv->snapshot);
+  usb_set_intfdata(intf, priv);
+
+  /* One line per device, the fields are in the snapshot */
+  dev_info(&intf->dev, "%s, %04x:%04x, speed %d, device %d\r\n",
+           id->driver_info ? (const char *)id->driver_info : "Unknown model",
+           le16_to_cpu(dev->descriptor.idVendor), le16_to_cpu(dev->descriptor.idProduct),
+           dev->speed, dev->devnum);
   return 0;
 }
 
 static void usb_disconnect(struct usb_interface *intf)
 {
+  struct driver_private *priv = usb_get_intfdata(intf);
+
   pr_info("Interface Driver : %s Invoked\r\n", __func__);
+
+  /* The snapshot file is already gone, usbcore removes it before disconnect */
+  usb_set_intfdata(intf, NULL);
+  kfree(priv->snapshot);
+  kfree(priv);
 }
 
+/* Match device and vendor ID, driver_info carries the model name.
+   More models can be added at runtime through new_id, see commands.txt */
 static struct usb_device_id usb_drv_mtable[] =
 {
-  {USB_DEVICE(VENDOR_ID, DEVICE_ID)},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_CRUZER_BLADE), .driver_info = (kernel_ulong_t)"SanDisk Cruzer Blade"},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA), .driver_info = (kernel_ulong_t)"SanDisk Ultra"},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA_FIT), .driver_info = (kernel_ulong_t)"SanDisk Ultra Fit"},
+  {USB_DEVICE(VENDOR_ID_KINGSTON, DEVICE_ID_DT_30), .driver_info = (kernel_ulong_t)"Kingston DataTraveler 3.0"},
+  {USB_DEVICE(VENDOR_ID_SAMSUNG, DEVICE_ID_BAR_PLUS), .driver_info = (kernel_ulong_t)"Samsung BAR Plus"},
   {}
 };
 
@@ -49,6 +216,9 @@ static struct usb_driver usb_drv =
   .probe      = usb_probe,
   .disconnect = usb_disconnect,
   .id_table   = usb_drv_mtable,
+  .dev_groups = usb_probe_groups,
+  /* Devices enumerating together are probed in parallel */
+  .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init usbprobe_init(void)
@@ -6,9 +6,20 @@
 #include <linux/kernel.h>
 #include <asm/uaccess.h>
 
-/* Sandisk Cruzer Data Flash Identification Codes */
-#define VENDOR_ID 0x0781
-#define DEVICE_ID 0x5567
+/* Vendor Identification Codes */
+#define VENDOR_ID_SANDISK  0x0781
+#define VENDOR_ID_KINGSTON 0x0951
+#define VENDOR_ID_SAMSUNG  0x090c
+
+/* Device Identification Codes */
+#define DEVICE_ID_CRUZER_BLADE 0x5567
+#define DEVICE_ID_ULTRA        0x5581
+#define DEVICE_ID_ULTRA_FIT    0x5583
+#define DEVICE_ID_DT_30        0x1666
+#define DEVICE_ID_BAR_PLUS     0x1000
+
+/* Bulk endpoints of one direction an interface can have */
+#define MAX_BULK_EPS 15
 
 /* Private Structure*/
 struct driver_private
@@ -19,12 +30,17 @@ struct driver_private
   struct usb_interface *usb_intf;
   /* Buffer to Receive Data */
   unsigned char *bulk_in_buffer;
-  /* Max Packet Size of the bulk endpoint */
+  /* Max Packet Size of the first bulk_in endpoint */
   size_t bulk_in_size;
-  /* The address of the bulk_in endpoint */
+  /* The address of the first bulk_in endpoint */
   __u8 bulk_in_endpointAddr;
-  /* The address of the bulk_out endpoint*/
+  /* The address of the first bulk_out endpoint*/
   __u8 bulk_out_endpointAddr;
+  /* Every bulk endpoint of the interface in descriptor order */
+  struct usb_endpoint_descriptor *bulk_in_eps[MAX_BULK_EPS];
+  struct usb_endpoint_descriptor *bulk_out_eps[MAX_BULK_EPS];
+  int nr_bulk_in_eps;
+  int nr_bulk_out_eps;
   /* kref count refers to active references of this structure */
   struct kref kref;
 };
@@ -61,7 +77,8 @@ static int usb_interface_drv_probe(struct usb_interface *intf, const struct usb_
     dev_err(&intf->dev, "Memory Allocation Failed\r\n");
     return -ENOMEM;
   }
-  dev->usb_dev  = interface_to_usbdev(intf);
+  kref_init(&dev->kref);
+  dev->usb_dev  = usb_get_dev(interface_to_usbdev(intf));
   dev->usb_intf = intf;
   
   /* The currently active alternate setting/interface */
@@ -72,41 +89,48 @@ static int usb_interface_drv_probe(struct usb_interface *intf, const struct usb_
   for(ii = 0; ii < iface_desc->desc.bNumEndpoints; ii++)
   {
     /* Copy current interface endpoint descriptor to driver local structure */
-    /* Use only first bulk_in and bulk_out endpoints */
+    /* Every bulk endpoint goes into the table of its direction */
     endpoint = &iface_desc->endpoint[ii].desc;
     
     /* Return true if endpoint has bulk transfer type and IN direction */
-    if(!usb_endpoint_is_bulk_in(endpoint))
-    {
-      /* Get bulk_in endpoint address */
-      dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-      /* Get max packet size */
-      dev->bulk_in_size = __le16_to_cpu(endpoint->wMaxPacketSize);
-      /* Allocate buffer to receive data from bulk_in endpoint */
-      dev->bulk_in_buffer = kmalloc(dev->bulk_in_size, GFP_KERNEL);
-      if(NULL == dev->bulk_in_buffer)
-      {
-        dev_err(&intf->dev, "Could Not Allocate bulk_in_buffer\r\n");
-        kref_put(&dev->kref, usb_cleanup);
-        return -ENOMEM;
-      }
-    }
+    if(usb_endpoint_is_bulk_in(endpoint) && dev->nr_bulk_in_eps < MAX_BULK_EPS)
+      dev->bulk_in_eps[dev->nr_bulk_in_eps++] = endpoint;
     /* Return true if endpoint has bulk transfer type and OUT direction */
-    if(!usb_endpoint_is_bulk_out(endpoint))
-    {
-      /* Get bulk_out endpoint address */
-      dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
-    }
+    else if(usb_endpoint_is_bulk_out(endpoint) && dev->nr_bulk_out_eps < MAX_BULK_EPS)
+      dev->bulk_out_eps[dev->nr_bulk_out_eps++] = endpoint;
   }
   /* Handle when bulk_in or bulk_out endpoints are not found */
-  if(!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr))
+  if(!(dev->nr_bulk_in_eps && dev->nr_bulk_out_eps))
   {
     pr_err("Could Not Find both bulk_in or bulk_out endpoints\r\n");
     kref_put(&dev->kref, usb_cleanup);
+    return -ENODEV;
+  }
+  for(ii = 0; ii < dev->nr_bulk_in_eps; ii++)
+    dev_info(&intf->dev, "bulk_in  endpoint 0x%02x, max packet size %d\r\n",
+             dev->bulk_in_eps[ii]->bEndpointAddress, usb_endpoint_maxp(dev->bulk_in_eps[ii]));
+  for(ii = 0; ii < dev->nr_bulk_out_eps; ii++)
+    dev_info(&intf->dev, "bulk_out endpoint 0x%02x, max packet size %d\r\n",
+             dev->bulk_out_eps[ii]->bEndpointAddress, usb_endpoint_maxp(dev->bulk_out_eps[ii]));
+
+  /* Use the first bulk_in and bulk_out endpoints */
+  /* Get bulk_in endpoint address */
+  dev->bulk_in_endpointAddr = dev->bulk_in_eps[0]->bEndpointAddress;
+  /* Get max packet size */
+  dev->bulk_in_size = usb_endpoint_maxp(dev->bulk_in_eps[0]);
+  /* Get bulk_out endpoint address */
+  dev->bulk_out_endpointAddr = dev->bulk_out_eps[0]->bEndpointAddress;
+  /* Allocate buffer to receive data from bulk_in endpoint */
+  dev->bulk_in_buffer = kmalloc(dev->bulk_in_size, GFP_KERNEL);
+  if(NULL == dev->bulk_in_buffer)
+  {
+    dev_err(&intf->dev, "Could Not Allocate bulk_in_buffer\r\n");
+    kref_put(&dev->kref, usb_cleanup);
     return -ENOMEM;
   }
   /* Save our private data pointer in interface device */
   usb_set_intfdata(intf, dev);
+  dev_info(&intf->dev, "%s attached\r\n", id->driver_info ? (const char *)id->driver_info : "Unknown model");
   return 0;
 }
 
@@ -124,9 +148,15 @@ static void usb_interface_drv_disconnect(struct usb_interface *intf)
   kref_put(&dev->kref, usb_cleanup);
 }
 
+/* Match device and vendor ID, driver_info carries the model name.
+   More models can be added at runtime through new_id, see commands.txt */
 static struct usb_device_id usb_drv_mtable[] =
 {
-  {USB_DEVICE(VENDOR_ID, DEVICE_ID)},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_CRUZER_BLADE), .driver_info = (kernel_ulong_t)"SanDisk Cruzer Blade"},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA), .driver_info = (kernel_ulong_t)"SanDisk Ultra"},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA_FIT), .driver_info = (kernel_ulong_t)"SanDisk Ultra Fit"},
+  {USB_DEVICE(VENDOR_ID_KINGSTON, DEVICE_ID_DT_30), .driver_info = (kernel_ulong_t)"Kingston DataTraveler 3.0"},
+  {USB_DEVICE(VENDOR_ID_SAMSUNG, DEVICE_ID_BAR_PLUS), .driver_info = (kernel_ulong_t)"Samsung BAR Plus"},
   {}
 };
 
@@ -136,6 +166,8 @@ static struct usb_driver usb_drv =
   .probe      = usb_interface_drv_probe,
   .disconnect = usb_interface_drv_disconnect,
   .id_table   = usb_drv_mtable,
+  /* Devices enumerating together are probed in parallel */
+  .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init usb_interface_drv_init(void)
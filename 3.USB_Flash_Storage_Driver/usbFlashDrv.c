@@ -5,11 +5,55 @@
 #include <linux/usb/ch9.h>
 #include <linux/slab.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/semaphore.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/dma-mapping.h>
+#include <linux/usb/hcd.h>
+#include <linux/scatterlist.h>
+#include <linux/uio.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/workqueue.h>
+#include <linux/poll.h>
+#include <linux/usb/storage.h>
+#include <scsi/scsi_proto.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/idr.h>
+#include <linux/sched/mm.h>
+#include <linux/completion.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sysfs.h>
+#include <linux/usb/uas.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/unaligned.h>
 #include <asm/uaccess.h>
 
-/* Sandisk Cruzer Data Flash Identification Codes */
-#define VENDOR_ID 0x0781
-#define DEVICE_ID 0x5567
+#include "usbFlashDrv.h"
+
+#define CREATE_TRACE_POINTS
+#include "usbFlashDrv_trace.h"
+
+/* Vendor Identification Codes */
+#define VENDOR_ID_SANDISK  0x0781
+#define VENDOR_ID_KINGSTON 0x0951
+#define VENDOR_ID_SAMSUNG  0x090c
+
+/* Device Identification Codes */
+#define DEVICE_ID_CRUZER_BLADE 0x5567
+#define DEVICE_ID_ULTRA        0x5581
+#define DEVICE_ID_ULTRA_FIT    0x5583
+#define DEVICE_ID_DT_30        0x1666
+#define DEVICE_ID_BAR_PLUS     0x1000
 
 #if 0
 /* Get actual device number range for usb devices from usb maintainer */
@@ -17,315 +61,4903 @@
 #define USB_MINOR_BASE 192
 #endif
 
+/* Number of bulk_in URBs the read engine keeps in flight */
+static unsigned int read_queue_depth = 8;
+module_param(read_queue_depth, uint, 0644);
+MODULE_PARM_DESC(read_queue_depth, "Number of bulk_in URBs kept in flight while reading");
+
+/* Upper bound of bulk_out URBs submitted and not yet completed */
+static unsigned int write_queue_depth = 8;
+module_param(write_queue_depth, uint, 0444);
+MODULE_PARM_DESC(write_queue_depth, "Number of bulk_out URBs allowed in flight");
+
+/* Number of URBs with DMA coherent buffers preallocated for each device */
+static unsigned int pool_size = 32;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Number of preallocated URBs per device");
+
+/* Size of the DMA coherent buffer attached to each pool URB */
+static unsigned int pool_buffer_size = 16384;
+module_param(pool_buffer_size, uint, 0444);
+MODULE_PARM_DESC(pool_buffer_size, "Size in bytes of each preallocated URB buffer");
+
+/* Transfers from this size on go out as one scatter-gather request */
+static unsigned int sg_min_size = 65536;
+module_param(sg_min_size, uint, 0644);
+MODULE_PARM_DESC(sg_min_size, "Smallest read/write in bytes sent as one scatter-gather request");
+
+/* Largest scatter-gather request, bigger transfers are split */
+static unsigned int sg_max_size = 4 * 1024 * 1024;
+module_param(sg_max_size, uint, 0444);
+MODULE_PARM_DESC(sg_max_size, "Largest scatter-gather request in bytes");
+
+/* Scatter-gather requests use the caller's pages instead of the bounce list when aligned */
+static bool direct_io = true;
+module_param(direct_io, bool, 0644);
+MODULE_PARM_DESC(direct_io, "Transfer large reads/writes of max packet aligned buffers straight from and to the pinned user pages");
+
+/* Keep the read engine posted from open to close instead of from the first read */
+static bool rx_always_armed;
+module_param(rx_always_armed, bool, 0644);
+MODULE_PARM_DESC(rx_always_armed, "Keep bulk_in URBs posted whenever the device is open");
+
+/* Gather small writes into one pool buffer before sending them */
+static bool write_combine;
+module_param(write_combine, bool, 0644);
+MODULE_PARM_DESC(write_combine, "Coalesce writes smaller than sg_min_size into pool buffer sized URBs");
+
+/* Longest time staged data waits for more writes */
+static unsigned int write_combine_ms = 10;
+module_param(write_combine_ms, uint, 0644);
+MODULE_PARM_DESC(write_combine_ms, "Milliseconds staged write data waits before it is sent anyway");
+
+/* Raw transfers are spread over this many bulk pairs of the interface */
+static unsigned int stripe_pairs;
+module_param(stripe_pairs, uint, 0444);
+MODULE_PARM_DESC(stripe_pairs, "Largest number of bulk endpoint pairs raw transfers are striped over, 0 for all, 1 disables striping");
+
+/* Streams asked for on each striped bulk endpoint of a SuperSpeed device */
+static unsigned int bulk_streams = 16;
+module_param(bulk_streams, uint, 0444);
+MODULE_PARM_DESC(bulk_streams, "Streams per bulk endpoint of raw transfers on SuperSpeed devices, 0 disables streams");
+
+/* Posted read engine and ring URBs share one completion interrupt per batch */
+static unsigned int irq_batch = 8;
+module_param(irq_batch, uint, 0644);
+MODULE_PARM_DESC(irq_batch, "Largest number of read engine and ring URBs completed by one interrupt, 1 interrupts on every URB");
+
+/* Tag depth of the block device request queue */
+static unsigned int blk_queue_depth = 32;
+module_param(blk_queue_depth, uint, 0444);
+MODULE_PARM_DESC(blk_queue_depth, "Number of requests the block device queue can hold");
+
+/* Largest block device request, 0 picks it from the bus speed */
+static unsigned int blk_max_sectors;
+module_param(blk_max_sectors, uint, 0444);
+MODULE_PARM_DESC(blk_max_sectors, "Largest block device request in 512 byte sectors, 0 for automatic");
+
+/* Leave the bulk pair of Bulk-Only sticks to raw transfers, read at probe */
+static bool raw_mode;
+module_param(raw_mode, bool, 0644);
+MODULE_PARM_DESC(raw_mode, "Give Bulk-Only sticks probed from now on raw transfers instead of a block device");
+
+/* Prefer the UAS alternate setting over Bulk-Only when streams are available */
+static bool uas_enable = true;
+module_param_named(uas, uas_enable, bool, 0444);
+MODULE_PARM_DESC(uas, "Use UAS tagged queuing on SuperSpeed devices that offer it");
+
+/* Time given to outstanding writes to drain on flush and fsync */
+#define DRV_WRITE_DRAIN_TIMEOUT_MS 10000
+
+/* Weights of the dispatch scheduler, see struct storage_qos */
+#define DRV_QOS_WEIGHT_DEFAULT 100
+#define DRV_QOS_WEIGHT_MAX     1000
+
+/* Recovery of raw transfers after stalls and link errors */
+/* Attempts before the parked transfers are failed */
+#define DRV_RECOVER_MAX_ATTEMPTS   6
+/* Attempts which only clear halts, the later ones reset the device */
+#define DRV_RECOVER_CLEAR_ATTEMPTS 2
+/* Delay before the second attempt, doubled for each further one */
+#define DRV_RECOVER_BACKOFF_MS     10
+#define DRV_RECOVER_BACKOFF_MAX_MS 1000
+
+/* Default timeout of each Bulk-Only Transport phase */
+#define DRV_BOT_TIMEOUT_MS 20000
+/* Upper bound of commands in one STORAGE_IOC_SCSI_BATCH */
+#define DRV_SCSI_MAX_BATCH 256
+/* Largest sense data fetched by automatic REQUEST SENSE */
+#define DRV_SENSE_SIZE 96
+
+/* Upper bound of UAS streams, one is kept for synchronous commands */
+#define DRV_UAS_MAX_STREAMS 256
+
+/* Profile quirks */
+/* Pool buffers come from kmalloc and are mapped per URB, for hosts whose
+   coherent memory is scarce or uncached */
+#define DRV_QUIRK_NO_COHERENT  BIT(0)
+/* Stay on Bulk-Only even when a UAS alternate setting is offered */
+#define DRV_QUIRK_NO_UAS       BIT(1)
+/* READ CAPACITY returns the number of blocks instead of the last block */
+#define DRV_QUIRK_FIX_CAPACITY BIT(2)
+
+/* Tuning of one stick model, picked through driver_info of the match table.
+   A field left at 0 falls back to the module parameter of the same name */
+struct drv_profile
+{
+  /* Model name printed at probe */
+  const char *name;
+  /* Size of each pool buffer, the largest transfer of the pool paths */
+  unsigned int pool_buffer_size;
+  /* bulk_in URBs of the read engine and bulk_out URBs allowed in flight */
+  unsigned int read_queue_depth;
+  unsigned int write_queue_depth;
+  /* Tag depth and largest request in sectors of the block device */
+  unsigned int blk_queue_depth;
+  unsigned int blk_max_sectors;
+  /* DRV_QUIRK_* */
+  unsigned long quirks;
+};
+
+/* Models without an entry of their own, e.g. added through new_id */
+static const struct drv_profile drv_profile_generic =
+{
+  .name = "Generic",
+};
+
+/* USB 2.0 stick, small packets and a slow controller behind them */
+static const struct drv_profile drv_profile_cruzer_blade =
+{
+  .name              = "SanDisk Cruzer Blade",
+  .pool_buffer_size  = 16384,
+  .read_queue_depth  = 8,
+  .write_queue_depth = 8,
+  .blk_queue_depth   = 32,
+  .blk_max_sectors   = 240,
+};
+
+/* USB 3.0 sticks, large transfers keep their controllers streaming */
+static const struct drv_profile drv_profile_sandisk_ultra =
+{
+  .name              = "SanDisk Ultra",
+  .pool_buffer_size  = 65536,
+  .read_queue_depth  = 16,
+  .write_queue_depth = 16,
+  .blk_queue_depth   = 64,
+  .blk_max_sectors   = 2048,
+};
+
+static const struct drv_profile drv_profile_kingston_dt30 =
+{
+  .name              = "Kingston DataTraveler 3.0",
+  .pool_buffer_size  = 65536,
+  .read_queue_depth  = 16,
+  .write_queue_depth = 8,
+  .blk_queue_depth   = 32,
+  .blk_max_sectors   = 1024,
+};
+
+static const struct drv_profile drv_profile_samsung_bar =
+{
+  .name              = "Samsung BAR Plus",
+  .pool_buffer_size  = 65536,
+  .read_queue_depth  = 16,
+  .write_queue_depth = 16,
+  .blk_queue_depth   = 64,
+  .blk_max_sectors   = 2048,
+};
+
+/* Scatter-gather entries of one block device request */
+#define DRV_BLK_MAX_SEGMENTS 128
+
+/* Upper bounds of a transfer ring set up through STORAGE_IOC_RING_SETUP */
+#define DRV_RING_MAX_ENTRIES 4096
+#define DRV_RING_MAX_BYTES   (64 * 1024 * 1024)
+
 static struct usb_driver usb_drv;
 
+/* Hands out the N of usbflashN */
+static DEFINE_IDA(drv_blk_ida);
+
+/* usb_flash_storage directory under the debugfs root of usbcore */
+static struct dentry *drv_debugfs_root;
+
+struct driver_private;
+
+/* Directions of the statistics */
+#define DRV_STAT_READ    0
+#define DRV_STAT_WRITE   1
+#define DRV_STAT_NR_DIRS 2
+/* log2 buckets of the latency histograms, in us */
+#define DRV_LAT_BUCKETS  32
+/* Bulk endpoints of one direction an interface can have */
+#define DRV_MAX_BULK_EPS 15
+
+/* Lanes of a self-test run, one bit per DRV_STAT_* direction */
+#define DRV_TEST_IN       BIT(DRV_STAT_READ)
+#define DRV_TEST_OUT      BIT(DRV_STAT_WRITE)
+#define DRV_TEST_LOOPBACK (DRV_TEST_IN | DRV_TEST_OUT)
+/* Data patterns of the self-test, numbered as in usbtest */
+#define DRV_TEST_PATTERN_ZERO  0
+#define DRV_TEST_PATTERN_MOD63 1
+/* A self-test without a single completion for this long is cancelled */
+#define DRV_TEST_STALL_MS 5000
+
+/* Counters of one CPU, summed up when read through sysfs */
+struct drv_stats
+{
+  u64 bytes[DRV_STAT_NR_DIRS];
+  u64 urbs[DRV_STAT_NR_DIRS];
+  /* Failed URBs, cancellations excluded, and the stalls among them */
+  u64 errors[DRV_STAT_NR_DIRS];
+  u64 stalls[DRV_STAT_NR_DIRS];
+  /* Submit to completion latency of each URB */
+  u64 latency[DRV_STAT_NR_DIRS][DRV_LAT_BUCKETS];
+};
+
+/* One bulk endpoint of the interface */
+struct drv_bulk_ep
+{
+  /* Endpoint address and max packet size */
+  unsigned int addr;
+  size_t max_size;
+  /* Bulk pipe of the endpoint */
+  unsigned int pipe;
+  /* Host side endpoint, streams are allocated on it */
+  struct usb_host_endpoint *hep;
+  /* Stream of the next URB submitted on this endpoint, 0 based */
+  atomic_t stream_next;
+  /* URBs submitted on this endpoint and not completed yet */
+  atomic_t inflight;
+  /* Bytes moved by completed URBs */
+  atomic64_t bytes;
+};
+
+/* Submission record of one URB, for the latency histograms and the tracepoints */
+struct drv_urb_stamp
+{
+  /* Time the URB was submitted */
+  u64 submit_ns;
+  /* Sequence number of the submission on its device */
+  u64 req_id;
+  /* Bulk endpoint of the interface the URB went to, NULL for the UAS pipes */
+  struct drv_bulk_ep *ep;
+};
+
+/* State of one open file handle */
+struct drv_file
+{
+  /* Device this handle was opened on */
+  struct driver_private *dev;
+  /* Held by the handle and by each of its writes in flight */
+  struct kref kref;
+  /* Error of a failed write of this handle, reported and cleared by its
+     next write, flush or fsync, protected by dev->bulk_out_lock */
+  int write_error;
+  /* Class, weight and caps of the handle, protected by dev->sched_lock
+     like the scheduling state below */
+  struct storage_qos qos;
+  /* Virtual time the last call of each direction finished at */
+  u64 vfinish[DRV_STAT_NR_DIRS];
+  /* Earliest time the caps let the handle dispatch again */
+  u64 cap_next_ns;
+};
+
+/* Raw read or write call waiting for its turn with the dispatch scheduler */
+struct drv_sched_req
+{
+  /* Links the call into the queue of its direction */
+  struct list_head list;
+  /* Handle making the call */
+  struct drv_file *ctx;
+  /* Virtual time the call starts at, calls are served lowest first */
+  u64 vstart;
+};
+
+/* Page list large transfers of one direction are gathered into */
+struct drv_sg_bounce
+{
+  /* Serializes users of the list */
+  struct mutex lock;
+  /* Allocated on first use, kept for the lifetime of the device */
+  struct scatterlist *sgl;
+  /* No of entries and bytes of sgl */
+  unsigned int nents;
+  size_t size;
+  /* Caller's pages pinned by a direct transfer and the list describing
+     them, max_pages entries each, allocated along with sgl */
+  struct page **pages;
+  struct scatterlist *direct;
+  unsigned int max_pages;
+};
+
+/* One URB and its DMA coherent buffer, preallocated in the device pool */
+struct drv_xfer
+{
+  /* Links the transfer into the free pool or the read or write engine queue */
+  struct list_head list;
+  /* URB used for data transfer on a bulk endpoint */
+  struct urb *urb;
+  /* DMA coherent buffer, its bus address is kept in urb->transfer_dma */
+  unsigned char *buffer;
+  /* Bus address of buffer, the recovery moves urb->transfer_dma away from it */
+  dma_addr_t dma;
+  /* Submission of the URB, for statistics and tracing */
+  struct drv_urb_stamp stamp;
+  /* No of received bytes already handed over to the reader */
+  size_t offset;
+  /* Set by the completion of a read engine transfer, protected by bulk_in_lock */
+  bool done;
+  /* Waiting for the recovery to submit it again, protected by bulk_in_lock
+     or bulk_out_lock, and the error it was parked with */
+  bool parked;
+  int status;
+  /* Length of a write and the bytes of it the device took before a recovery */
+  size_t len;
+  size_t sent;
+  /* Device owning this transfer */
+  struct driver_private *dev;
+
+  /* Asynchronous request completed by this transfer, NULL for synchronous I/O */
+  struct kiocb *iocb;
+  /* Handle whose write this is, NULL for staged data of any handle */
+  struct drv_file *owner;
+  /* User pages an asynchronous read lands in, pinned at submission */
+  struct page **pages;
+  /* No of pinned pages and the offset of the data in the first one */
+  unsigned int nr_pages;
+  size_t page_offset;
+  /* No of bytes the asynchronous reader asked for */
+  size_t aio_len;
+  /* Finishes an asynchronous read in process context */
+  struct work_struct aio_work;
+};
+
+/* Transfer in flight for one buffer of the ring */
+struct drv_ring_req
+{
+  /* URB pointing straight into the ring buffer */
+  struct urb *urb;
+  /* Ring owning this request */
+  struct drv_ring *ring;
+  /* Index of the ring buffer used by this request */
+  unsigned int index;
+  /* user_data of the submission entry, echoed in the completion entry */
+  __u64 user_data;
+  /* True while the URB is submitted, protected by ring->lock */
+  bool busy;
+  /* Submission of the URB, for statistics and tracing */
+  struct drv_urb_stamp stamp;
+};
+
+/* Shared submission/completion ring mapped into the application */
+struct drv_ring
+{
+  /* Device owning this ring */
+  struct driver_private *dev;
+  /* Header, submission and completion queues in one vmalloc_user() block */
+  struct storage_ring_hdr *hdr;
+  struct storage_sqe *sqes;
+  struct storage_cqe *cqes;
+  /* Size of the queues region */
+  size_t queues_bytes;
+  /* No of submission and completion entries */
+  unsigned int nr_entries;
+  /* DMA coherent transfer buffers, mapped into the application */
+  unsigned char *buffers;
+  dma_addr_t buffers_dma;
+  /* Size of the buffers region */
+  size_t buffers_bytes;
+  /* No of buffers and the page aligned size of each */
+  unsigned int nr_buffers;
+  size_t buffer_size;
+  /* One request per buffer */
+  struct drv_ring_req *reqs;
+  /* Anchor holding every ring URB currently submitted */
+  struct usb_anchor anchor;
+  /* Protects the completion queue tail and the busy flags */
+  spinlock_t lock;
+  /* No of ring URBs submitted and not completed, protected by lock */
+  unsigned int inflight;
+  /* STORAGE_IOC_RING_ENTER sleeps here waiting for completions */
+  wait_queue_head_t wait;
+  /* No of live mappings of either region */
+  atomic_t mapped;
+  /* No of threads sleeping in STORAGE_IOC_RING_ENTER, protected by ring_mutex */
+  unsigned int waiters;
+};
+
+/* One SCSI command handed to the transport */
+struct drv_scsi_cmd
+{
+  /* Command descriptor block and its length */
+  const u8 *cdb;
+  unsigned int cdb_len;
+  /* Logical unit the command is addressed to */
+  u8 lun;
+  /* STORAGE_DIR_* direction of the data phase */
+  int dir;
+  /* Data phase buffers, len bytes spread over nents entries */
+  struct scatterlist *sg;
+  unsigned int nents;
+  unsigned int len;
+  /* Timeout of each phase in jiffies */
+  unsigned long timeout;
+  /* Buffer for the sense data a transport returns along with the status */
+  u8 *sense;
+  unsigned int sense_len;
+  /* Out : Bytes of the data phase that did not move */
+  unsigned int residue;
+  /* Out : Status from the Command Status Wrapper or the Sense IU */
+  u8 status;
+  /* Out : Sense bytes stored, only UAS delivers sense without asking */
+  unsigned int sense_written;
+};
+
+/* One tagged command slot of the UAS transport */
+struct drv_uas_cmd
+{
+  /* Device owning this slot */
+  struct driver_private *dev;
+  /* Command being run */
+  struct drv_scsi_cmd *scsi;
+  /* UAS tag, also the stream ID of the status and data URBs */
+  u16 tag;
+  /* URBs of the command, status and data pipes */
+  struct urb *cmd_urb;
+  struct urb *status_urb;
+  struct urb *data_urb;
+  /* DMA-able Command IU and the Sense IU the status URB lands in */
+  struct command_iu *cmd_iu;
+  struct sense_iu *sense_iu;
+  /* URBs not completed yet */
+  atomic_t pending;
+  /* First error seen by any of the URBs */
+  int result;
+  /* Called once all URBs have completed */
+  void (*done)(struct drv_uas_cmd *uas);
+};
+
+/* One direction of a self-test run */
+struct drv_test_lane
+{
+  /* URBs still to submit and URBs in flight */
+  unsigned int to_submit;
+  unsigned int inflight;
+  /* Completed URBs and the bytes they moved */
+  u64 urbs;
+  u64 bytes;
+  /* Failed URBs, and received URBs whose data broke the pattern */
+  u64 errors;
+  u64 mismatches;
+};
+
+/* Parameters of a self-test run */
+struct drv_test_params
+{
+  /* Bytes per URB, at most one pool buffer */
+  u32 size;
+  /* URBs per lane */
+  u32 iterations;
+  /* URBs each lane keeps in flight */
+  u32 queue_depth;
+  /* DRV_TEST_PATTERN_* */
+  u32 pattern;
+};
+
+/* In-kernel bulk self-test driven through debugfs */
+struct drv_test
+{
+  /* storage%d directory of the device */
+  struct dentry *dir;
+  /* Parameters of the next run and those the last run went with */
+  struct drv_test_params params;
+  struct drv_test_params last;
+  /* Every self-test URB in flight */
+  struct usb_anchor anchor;
+  /* Protects the lanes, status and mismatch_offset against the completion handler */
+  spinlock_t lock;
+  /* The runner sleeps here until the lanes drain */
+  wait_queue_head_t wait;
+  /* Lanes indexed by DRV_STAT_*, the last run's DRV_TEST_* mode selects them */
+  struct drv_test_lane lane[DRV_STAT_NR_DIRS];
+  int mode;
+  /* 0 or the first error of the last run */
+  int status;
+  /* Offset of the first bad byte received, -1 when all matched */
+  int mismatch_offset;
+  /* Time from the first submission until the lanes drained */
+  u64 elapsed_ns;
+};
+
 /* Private Structure */
 struct driver_private
 {
-  /* Private usb_device structure */
-  struct usb_device *usb_dev;
-  /* Private usb_interface structure */
-  struct usb_interface *usb_intf; 
-  /* kref count refers to active references of this structure */
-  struct kref kref;
+  /* Private usb_device structure */
+  struct usb_device *usb_dev;
+  /* Private usb_interface structure */
+  struct usb_interface *usb_intf; 
+  /* kref count refers to active references of this structure */
+  struct kref kref;
+  /* Tuning of this model, from driver_info of the matching entry */
+  const struct drv_profile *profile;
+
+  /* Per-CPU counters exported under the interface, storage%d/device/stats */
+  struct drv_stats __percpu *stats;
+  /* URBs in flight in each direction and the highest depth seen */
+  atomic_t stat_inflight[DRV_STAT_NR_DIRS];
+  atomic_t stat_inflight_max[DRV_STAT_NR_DIRS];
+  /* Hands out the req_id of each submitted URB */
+  atomic64_t urb_seq;
+
+  /* Serializes URB submission against disconnect, held throughout by
+     SCSI batches and self-tests which own the bulk endpoints */
+  struct mutex io_mutex;
+  /* Serializes readers, which queue for it in arrival order, and owns the read engine */
+  struct mutex read_mutex;
+  /* Serializes writers, each write() reaches the endpoint in one piece */
+  struct mutex write_mutex;
+  /* Set once the device is gone, checked under io_mutex */
+  bool disconnected;
+  /* No of open file handles of this device, protected by io_mutex */
+  int open_count;
+
+  /* Transfers preallocated at probe, released by usb_cleanup */
+  struct drv_xfer *pool;
+  /* No of entries in pool */
+  unsigned int pool_nr_xfers;
+  /* Size of the buffer attached to each pool transfer */
+  size_t pool_buffer_size;
+  /* Transfers currently not used by any I/O */
+  struct list_head pool_free;
+  /* Protects pool_free, transfers come back from completion handlers */
+  spinlock_t pool_lock;
+  /* Writers sleep here until a transfer returns to the pool */
+  wait_queue_head_t pool_wait;
+
+  /* Anchor holding every bulk_in URB currently submitted */
+  struct usb_anchor bulk_in_anchor;
+  /* Posted transfers in submission order, read() consumes them from the
+     head as they complete since striped pairs complete out of order */
+  struct list_head bulk_in_queue;
+  /* Protects bulk_in_queue, the done and parked flags against the completion handler */
+  spinlock_t bulk_in_lock;
+  /* Readers sleep here until a request completes */
+  wait_queue_head_t bulk_in_wait;
+  /* True while the read engine keeps URBs posted */
+  bool bulk_in_running;
+  /* Consumed transfers posted again together once a batch is complete,
+     protected by read_mutex */
+  struct list_head bulk_in_batch;
+  unsigned int bulk_in_batch_len;
+  /* The address of the first bulk_in endpoint */
+  unsigned int bulk_in_endpointAddr; 
+  /* Max packet size of the first bulk_in endpoint */
+  size_t bulk_in_max_size;
+  /* Save the error state of URB used for reading from bulk_in endpoint */
+  int bulk_in_errors;
+
+  /* Anchor holding every asynchronous bulk_in URB currently submitted */
+  struct usb_anchor aio_in_anchor;
+
+  /* Anchor holding every bulk_out URB currently submitted */
+  struct usb_anchor bulk_out_anchor;
+  /* Writes submitted or parked, in submission order, protected by bulk_out_lock */
+  struct list_head bulk_out_queue;
+  /* Limits the number of bulk_out URBs in flight to write_queue_depth */
+  struct semaphore bulk_out_limit;
+  /* No of slots of bulk_out_limit taken, tells poll whether a write would block */
+  atomic_t bulk_out_inflight;
+  /* Protects bulk_out_errors and bulk_out_queue against the completion handler */
+  spinlock_t bulk_out_lock;
+  /* The address of the first bulk_out endpoint */
+  unsigned int bulk_out_endpointAddr; 
+  /* Max packet size of the first bulk_out endpoint */
+  size_t bulk_out_max_size;
+  /* Save the error state of URB used for writing to bulk_out endpoint,
+     reported and cleared by the next write, flush or fsync */
+  int bulk_out_errors;
+
+  /* Bulk endpoints of the interface in descriptor order, indexed by DRV_STAT_*.
+     Pair N is the Nth bulk_in and the Nth bulk_out endpoint, pair 0 is the
+     one above, which SCSI commands, the ring and the self-test stay on */
+  struct drv_bulk_ep bulk_eps[DRV_STAT_NR_DIRS][DRV_MAX_BULK_EPS];
+  unsigned int nr_bulk_eps[DRV_STAT_NR_DIRS];
+  /* No of pairs read(), write() and their asynchronous forms round-robin over */
+  unsigned int nr_stripes;
+  /* Pair of the next striped transfer of each direction */
+  atomic_t stripe_next[DRV_STAT_NR_DIRS];
+  /* Streams of each striped endpoint, 0 when they run without streams */
+  unsigned int bulk_streams;
+
+  /* Serializes users of the write-combining stage */
+  struct mutex wc_mutex;
+  /* Pool transfer small writes are gathered in, NULL when nothing is staged */
+  struct drv_xfer *wc_xfer;
+  /* No of bytes staged in wc_xfer */
+  size_t wc_len;
+  /* Sends the staged bytes write_combine_ms after the first of them */
+  struct delayed_work wc_work;
+
+  /* Clears halts or resets the device, then submits the parked transfers */
+  struct delayed_work recover_work;
+  /* Held by the recovery and across a reset, raw transfers are not submitted meanwhile */
+  struct mutex recover_mutex;
+  /* Set while the recovery cancels the raw URBs, the cancelled ones are parked */
+  bool recovering;
+  /* Recovery attempts since the last raw transfer that went through */
+  unsigned int recover_attempts;
+
+  /* Protects the dispatch scheduler of raw reads and writes */
+  spinlock_t sched_lock;
+  /* Calls waiting for their turn, per direction in arrival order */
+  struct list_head sched_queue[DRV_STAT_NR_DIRS];
+  /* Set while a call of the direction is dispatched */
+  bool sched_busy[DRV_STAT_NR_DIRS];
+  /* Virtual time of each direction, the start of the last call dispatched */
+  u64 sched_vtime[DRV_STAT_NR_DIRS];
+  /* Waiting calls of both directions sleep here */
+  wait_queue_head_t sched_wait;
+
+  /* Bounce lists of large reads and writes, indexed by DRV_STAT_*, so that
+     both directions run at once. SCSI batches use the read one */
+  struct drv_sg_bounce sg_bounce[DRV_STAT_NR_DIRS];
+
+  /* True when the interface speaks the Bulk-Only Transport */
+  bool bot_capable;
+  /* Serializes synchronous commands, and every command on Bulk-Only */
+  struct mutex cmd_mutex;
+  /* DMA-able Command Block Wrapper, Command Status Wrapper and sense buffer */
+  struct bulk_cb_wrap *bot_cbw;
+  struct bulk_cs_wrap *bot_csw;
+  u8 *bot_sense;
+  /* Tag of the last Command Block Wrapper sent, protected by cmd_mutex */
+  u32 bot_tag;
+
+  /* True once the UAS alternate setting is active, raw transfers are off then */
+  bool uas;
+  /* Pipes of the UAS alternate setting */
+  unsigned int uas_cmd_pipe;
+  unsigned int uas_status_pipe;
+  unsigned int uas_data_in_pipe;
+  unsigned int uas_data_out_pipe;
+  /* Status, data-in and data-out endpoints carrying the streams */
+  struct usb_host_endpoint *uas_stream_eps[3];
+  unsigned int uas_streams;
+  /* Every UAS URB in flight */
+  struct usb_anchor uas_anchor;
+  /* Slot of the synchronous commands and its completion */
+  struct drv_uas_cmd uas_exec;
+  struct completion uas_exec_done;
+
+  /* Serializes ring setup, submission and teardown */
+  struct mutex ring_mutex;
+  /* Transfer ring set up by STORAGE_IOC_RING_SETUP, protected by ring_mutex */
+  struct drv_ring *ring;
+
+  /* Block device frontend, NULL when there is no Bulk-Only medium to size */
+  struct gendisk *disk;
+  struct blk_mq_tag_set tag_set;
+  int disk_index;
+  /* log2 of the logical block size and the capacity in 512 byte sectors */
+  unsigned int blk_shift;
+  sector_t blk_capacity;
+
+  /* Bulk self-test under debugfs */
+  struct drv_test test;
+};
+
+#define get_driver_private(ptr) container_of(ptr, struct driver_private, kref)
+
+/* Profile value of a device, or the module parameter when the profile has none */
+#define drv_tune(dev, field) ((dev)->profile->field ? (dev)->profile->field : (field))
+
+static void drv_ring_free(struct driver_private *dev, struct drv_ring *ring);
+static void drv_uas_cmd_free(struct drv_uas_cmd *uas);
+
+/* Release the transfer pool, none of its URBs may be in flight */
+static void drv_pool_destroy(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+  unsigned int ii;
+
+  for(ii = 0; ii < dev->pool_nr_xfers; ii++)
+  {
+    xfer = &dev->pool[ii];
+    if(xfer->buffer && (dev->profile->quirks & DRV_QUIRK_NO_COHERENT))
+      kfree(xfer->buffer);
+    else if(xfer->buffer)
+      usb_free_coherent(dev->usb_dev, dev->pool_buffer_size, xfer->buffer, xfer->dma);
+    usb_free_urb(xfer->urb);
+    kfree(xfer->pages);
+  }
+  kfree(dev->pool);
+  dev->pool = NULL;
+  dev->pool_nr_xfers = 0;
+}
+
+static void drv_aio_read_work(struct work_struct *work);
+
+/* Preallocate the URBs and DMA coherent buffers used by all I/O of a device */
+static int drv_pool_create(struct driver_private *dev)
+{
+  unsigned int nr = max(pool_size, 2U);
+  size_t packet = dev->bulk_in_max_size;
+  struct drv_xfer *xfer;
+  unsigned int ii;
+
+  /* Round the buffer up to whole packets of every striped bulk_in endpoint so
+     that no read ends in a babble, bulk packet sizes are all powers of 2 */
+  for(ii = 1; ii < dev->nr_stripes; ii++)
+    packet = max(packet, dev->bulk_eps[DRV_STAT_READ][ii].max_size);
+  dev->pool_buffer_size = roundup(max_t(size_t, drv_tune(dev, pool_buffer_size), packet), packet);
+
+  dev->pool = kcalloc(nr, sizeof(*dev->pool), GFP_KERNEL);
+  if(!dev->pool)
+    return -ENOMEM;
+
+  for(ii = 0; ii < nr; ii++)
+  {
+    xfer = &dev->pool[ii];
+    xfer->dev = dev;
+
+    /* Create an URB for the USB driver to use for data transfer */
+    /* For bulk endpoints, the first argument has to be 0 */
+    xfer->urb = usb_alloc_urb(0, GFP_KERNEL);
+    if(!xfer->urb)
+      goto error;
+    dev->pool_nr_xfers++;
+
+    if(dev->profile->quirks & DRV_QUIRK_NO_COHERENT)
+    {
+      /* Plain buffer, the host controller driver maps it for each URB */
+      xfer->buffer = kmalloc(dev->pool_buffer_size, GFP_KERNEL);
+      if(!xfer->buffer)
+        goto error;
+    }
+    else
+    {
+      /* Allocate DMA coherent buffer, it stays mapped for the device lifetime */
+      xfer->buffer = usb_alloc_coherent(dev->usb_dev, dev->pool_buffer_size, GFP_KERNEL, &xfer->urb->transfer_dma);
+      if(!xfer->buffer)
+        goto error;
+      xfer->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+      xfer->dma = xfer->urb->transfer_dma;
+    }
+
+    /* Room for the user pages of an asynchronous read filling the buffer */
+    xfer->pages = kcalloc(dev->pool_buffer_size / PAGE_SIZE + 2, sizeof(*xfer->pages), GFP_KERNEL);
+    if(!xfer->pages)
+      goto error;
+    INIT_WORK(&xfer->aio_work, drv_aio_read_work);
+
+    list_add_tail(&xfer->list, &dev->pool_free);
+  }
+  return 0;
+
+error:
+  dev_err(&dev->usb_intf->dev, "Could not allocate pool transfer %u\r\n", ii);
+  INIT_LIST_HEAD(&dev->pool_free);
+  drv_pool_destroy(dev);
+  return -ENOMEM;
+}
+
+/* Take a transfer out of the pool, returns NULL when all are in use */
+static struct drv_xfer *drv_pool_get(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->pool_lock, flags);
+  xfer = list_first_entry_or_null(&dev->pool_free, struct drv_xfer, list);
+  if(xfer)
+    list_del_init(&xfer->list);
+  spin_unlock_irqrestore(&dev->pool_lock, flags);
+  return xfer;
+}
+
+/* Check whether the pool has a free transfer without taking it */
+static bool drv_pool_available(struct driver_private *dev)
+{
+  bool avail;
+  unsigned long flags;
+
+  spin_lock_irqsave(&dev->pool_lock, flags);
+  avail = !list_empty(&dev->pool_free);
+  spin_unlock_irqrestore(&dev->pool_lock, flags);
+  return avail;
+}
+
+/* Give a transfer back to the pool, may be called from completion handlers */
+static void drv_pool_put(struct driver_private *dev, struct drv_xfer *xfer)
+{
+  unsigned long flags;
+
+  /* The next user of the transfer may not want a zero length packet, a
+     silent completion, nor the buffer offset a recovery left behind */
+  xfer->urb->transfer_flags &= ~(URB_ZERO_PACKET | URB_NO_INTERRUPT);
+  xfer->urb->transfer_dma = xfer->dma;
+  xfer->parked = false;
+  spin_lock_irqsave(&dev->pool_lock, flags);
+  list_add(&xfer->list, &dev->pool_free);
+  spin_unlock_irqrestore(&dev->pool_lock, flags);
+  wake_up(&dev->pool_wait);
+}
+
+static void usb_cleanup(struct kref *kref)
+{
+  struct driver_private *dev;
+  int ii;
+ 
+  /* Fetch the parent private structure from kref field */
+  dev = get_driver_private(kref);
+  /* No opener is left to stage data, the staged transfer goes with the pool */
+  cancel_delayed_work_sync(&dev->wc_work);
+  cancel_delayed_work_sync(&dev->recover_work);
+  /* Free the transfer ring if the last opener did not tear it down */
+  if(dev->ring)
+    drv_ring_free(dev, dev->ring);
+  /* Free the URBs and buffers of the transfer pool */
+  drv_pool_destroy(dev);
+  /* Free the pages of the scatter-gather bounce lists */
+  for(ii = 0; ii < DRV_STAT_NR_DIRS; ii++)
+  {
+    if(dev->sg_bounce[ii].sgl)
+      sgl_free(dev->sg_bounce[ii].sgl);
+    kfree(dev->sg_bounce[ii].pages);
+    kfree(dev->sg_bounce[ii].direct);
+  }
+  /* Free the Bulk-Only Transport wrappers */
+  kfree(dev->bot_cbw);
+  kfree(dev->bot_csw);
+  kfree(dev->bot_sense);
+  /* Free the slot of synchronous UAS commands */
+  drv_uas_cmd_free(&dev->uas_exec);
+  /* Free the per-CPU counters */
+  free_percpu(dev->stats);
+  /* Decrement the kref count */
+  usb_put_dev(dev->usb_dev);
+  /* Free the memory allocated for driver private structure */
+  kfree(dev);
+}
+
+/* Check whether raw transfers may use the bulk pair. UAS replaced it, and
+   the block device owns it on Bulk-Only since raw URBs would swallow its
+   CSWs or land between its CBWs and data phases */
+static int drv_raw_usable(struct driver_private *dev)
+{
+  if(dev->uas)
+    return -EOPNOTSUPP;
+  if(dev->disk)
+    return -EBUSY;
+  return 0;
+}
+
+/* Bulk endpoint of the interface a pipe points to, NULL when it is not one of them */
+static struct drv_bulk_ep *drv_bulk_ep_of(struct driver_private *dev, unsigned int pipe)
+{
+  int dir = usb_pipein(pipe) ? DRV_STAT_READ : DRV_STAT_WRITE;
+  unsigned int ii;
+
+  /* The table describes the Bulk-Only setting, UAS pipes are not counted in it */
+  if(dev->uas)
+    return NULL;
+  for(ii = 0; ii < dev->nr_bulk_eps[dir]; ii++)
+    if(usb_pipeendpoint(dev->bulk_eps[dir][ii].pipe) == usb_pipeendpoint(pipe))
+      return &dev->bulk_eps[dir][ii];
+  return NULL;
+}
+
+/* Advance a round-robin counter over nr slots, returns the slot taken */
+static unsigned int drv_rotate(atomic_t *next, unsigned int nr)
+{
+  int slot = atomic_read(next);
+
+  while(!atomic_try_cmpxchg(next, &slot, (slot + 1) % nr))
+    ;
+  return slot;
+}
+
+/* Pick the endpoint of the next striped transfer of a direction, the pairs
+   take turns so that the device can put the stream back together in order */
+static struct drv_bulk_ep *drv_stripe_ep(struct driver_private *dev, int dir)
+{
+  return &dev->bulk_eps[dir][drv_rotate(&dev->stripe_next[dir], dev->nr_stripes)];
+}
+
+/* Scatter-gather requests need the first pair to themselves, striped and
+   stream-tagged transfers go through the pool instead */
+static bool drv_sg_usable(struct driver_private *dev)
+{
+  return dev->nr_stripes == 1 && !dev->bulk_streams;
+}
+
+/* Count one URB as in flight and stamp its submission, called right before usb_submit_urb() */
+static void drv_urb_submit(struct driver_private *dev, struct urb *urb, struct drv_urb_stamp *stamp)
+{
+  int dir = usb_pipein(urb->pipe) ? DRV_STAT_READ : DRV_STAT_WRITE;
+  int inflight = atomic_inc_return(&dev->stat_inflight[dir]);
+  int peak = atomic_read(&dev->stat_inflight_max[dir]);
+
+  while(inflight > peak && !atomic_try_cmpxchg(&dev->stat_inflight_max[dir], &peak, inflight))
+    ;
+  stamp->ep = drv_bulk_ep_of(dev, urb->pipe);
+  if(stamp->ep)
+  {
+    atomic_inc(&stamp->ep->inflight);
+    /* Outstanding URBs of an endpoint with streams take them in turn, so
+       the device can serve them out of order. IDs start at 1 */
+    urb->stream_id = dev->bulk_streams ? drv_rotate(&stamp->ep->stream_next, dev->bulk_streams) + 1 : 0;
+  }
+  stamp->req_id = atomic64_inc_return(&dev->urb_seq);
+  stamp->submit_ns = ktime_get_ns();
+  trace_usbflash_urb_submit(dev->usb_intf->minor, urb, 0, stamp->req_id);
+}
+
+/* Undo drv_urb_submit() for an URB that usb_submit_urb() refused */
+static void drv_urb_submit_failed(struct driver_private *dev, struct urb *urb, struct drv_urb_stamp *stamp, int error)
+{
+  atomic_dec(&dev->stat_inflight[usb_pipein(urb->pipe) ? DRV_STAT_READ : DRV_STAT_WRITE]);
+  if(stamp->ep)
+    atomic_dec(&stamp->ep->inflight);
+  trace_usbflash_urb_error(dev->usb_intf->minor, urb, error, stamp->req_id);
+}
+
+/* Trace the outcome of a completed URB */
+static void drv_urb_trace_done(struct driver_private *dev, struct urb *urb, u64 req_id)
+{
+  if(!urb->status)
+    trace_usbflash_urb_complete(dev->usb_intf->minor, urb, urb->status, req_id);
+  else if(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN)
+    trace_usbflash_urb_cancel(dev->usb_intf->minor, urb, urb->status, req_id);
+  else
+    trace_usbflash_urb_error(dev->usb_intf->minor, urb, urb->status, req_id);
+}
+
+/* Account a completed URB on this CPU, called from its completion handler */
+static void drv_urb_complete(struct driver_private *dev, struct urb *urb, struct drv_urb_stamp *stamp)
+{
+  int dir = usb_pipein(urb->pipe) ? DRV_STAT_READ : DRV_STAT_WRITE;
+  u64 usecs = div_u64(ktime_get_ns() - stamp->submit_ns, NSEC_PER_USEC);
+  unsigned int bucket = usecs ? min_t(unsigned int, ilog2(usecs) + 1, DRV_LAT_BUCKETS - 1) : 0;
+
+  atomic_dec(&dev->stat_inflight[dir]);
+  if(stamp->ep)
+  {
+    atomic_dec(&stamp->ep->inflight);
+    atomic64_add(urb->actual_length, &stamp->ep->bytes);
+  }
+  this_cpu_inc(dev->stats->urbs[dir]);
+  this_cpu_add(dev->stats->bytes[dir], urb->actual_length);
+  this_cpu_inc(dev->stats->latency[dir][bucket]);
+  drv_urb_trace_done(dev, urb, stamp->req_id);
+
+  /* Cancellations from disconnect or an engine stop are not device errors */
+  if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+  {
+    this_cpu_inc(dev->stats->errors[dir]);
+    if(urb->status == -EPIPE)
+      this_cpu_inc(dev->stats->stalls[dir]);
+  }
+}
+
+/* Errors a clear-halt or a reset may cure, stalls and link level failures */
+static bool drv_urb_recoverable(int status)
+{
+  return status == -EPIPE || status == -EPROTO || status == -EILSEQ || status == -ETIME;
+}
+
+/* Queue the recovery, after a delay which grows with the attempts already made */
+static void drv_recover_schedule(struct driver_private *dev)
+{
+  unsigned int attempts = READ_ONCE(dev->recover_attempts);
+  unsigned long delay = 0;
+
+  if(attempts)
+    delay = msecs_to_jiffies(min(DRV_RECOVER_BACKOFF_MS << min(attempts - 1, 16U), DRV_RECOVER_BACKOFF_MAX_MS));
+  schedule_delayed_work(&dev->recover_work, delay);
+}
+
+/* Called when the submitted URB transfer is completed */
+static void drv_read_bulk_callback(struct urb *urb)
+{
+  struct drv_xfer *xfer;
+  struct driver_private *dev;
+  unsigned long flags;
+  bool cancelled;
+  bool recover;
+  
+  /* Restore transfer and driver private structure from URB */
+  xfer = urb->context;
+  dev = xfer->dev;
+  drv_urb_complete(dev, urb, &xfer->stamp);
+
+  /* Check status of the URB transaction */
+  if(urb->status) 
+  {
+    if(!(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+      dev_err(&dev->usb_intf->dev,"%s - nonzero read bulk status received: %d\n",__func__, urb->status);
+
+    dev->bulk_in_errors = urb->status;
+  } 
+
+  /* Transfers lost to a link error or cancelled by the recovery are retried
+     while the engine runs, the others are final */
+  cancelled = urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN;
+  recover = urb->status && READ_ONCE(dev->bulk_in_running) && !READ_ONCE(dev->disconnected) &&
+            (drv_urb_recoverable(urb->status) || (cancelled && READ_ONCE(dev->recovering)));
+
+  /* Mark the transfer ready in its place of the queue, failed transfers
+     are marked as well so that the reader can report and recycle them */
+  spin_lock_irqsave(&dev->bulk_in_lock, flags);
+  xfer->offset = 0;
+  xfer->status = urb->status;
+  if(recover && !urb->actual_length)
+  {
+    /* Keep its place, the recovery posts it again */
+    xfer->parked = true;
+  }
+  else
+  {
+    /* Data which arrived before the failure is handed out as it is */
+    if(recover)
+      xfer->status = 0;
+    xfer->done = true;
+  }
+  spin_unlock_irqrestore(&dev->bulk_in_lock, flags);
+
+  if(recover && !cancelled)
+    drv_recover_schedule(dev);
+  else if(!urb->status)
+    WRITE_ONCE(dev->recover_attempts, 0);
+
+  /* A full transfer completing without an interrupt of its own is followed
+     by one that has it on the same endpoint, the readers wake up for that.
+     When posting the batch failed, drv_read_post() unlinks it instead */
+  if((urb->transfer_flags & URB_NO_INTERRUPT) && !urb->status &&
+     urb->actual_length == urb->transfer_buffer_length)
+    return;
+
+  /* Signal threads waiting for data to wake up */
+  wake_up_interruptible(&dev->bulk_in_wait);
+}
+
+/* Size of the batches sharing a completion interrupt, at most half the
+   depth so that the other half keeps the endpoints busy meanwhile */
+static unsigned int drv_irq_batch(unsigned int depth)
+{
+  return clamp(READ_ONCE(irq_batch), 1U, max(depth / 2, 1U));
+}
+
+/* Post one pool transfer on the next striped bulk_in endpoint, behind the ones posted before it */
+static int drv_read_submit(struct driver_private *dev, struct drv_xfer *xfer, bool irq)
+{
+  int retval;
+
+  /* The recovery resubmits parked transfers in order, nothing may overtake them */
+  mutex_lock(&dev->recover_mutex);
+
+  /* Initialize URB, only the last one of a batch raises the interrupt */
+  usb_fill_bulk_urb(xfer->urb, dev->usb_dev, drv_stripe_ep(dev, DRV_STAT_READ)->pipe,
+                    xfer->buffer, dev->pool_buffer_size,
+                    drv_read_bulk_callback, xfer);
+  if(irq)
+    xfer->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+  else
+    xfer->urb->transfer_flags |= URB_NO_INTERRUPT;
+
+  /* Queue the transfer so that its data is read in the order it was asked for */
+  spin_lock_irq(&dev->bulk_in_lock);
+  xfer->done = false;
+  list_add_tail(&xfer->list, &dev->bulk_in_queue);
+  spin_unlock_irq(&dev->bulk_in_lock);
+
+  /* Track the URB so that it can be killed when the engine stops */
+  usb_anchor_urb(xfer->urb, &dev->bulk_in_anchor);
+
+  /* Submit URB to receive data via bulk_in endpoint */
+  drv_urb_submit(dev, xfer->urb, &xfer->stamp);
+  retval = usb_submit_urb(xfer->urb, GFP_KERNEL);
+  if(retval < 0) 
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Failed submitting read urb, error %d\n",__func__, retval);
+    drv_urb_submit_failed(dev, xfer->urb, &xfer->stamp, retval);
+    usb_unanchor_urb(xfer->urb);
+    spin_lock_irq(&dev->bulk_in_lock);
+    list_del_init(&xfer->list);
+    spin_unlock_irq(&dev->bulk_in_lock);
+  }
+  mutex_unlock(&dev->recover_mutex);
+  return retval;
+}
+
+/* Stop the read engine and drop whatever it had received, called with read_mutex held */
+static void drv_read_stop(struct driver_private *dev)
+{
+  struct drv_xfer *xfer, *tmp;
+  LIST_HEAD(done);
+
+  dev->bulk_in_running = false;
+
+  /* Keep the recovery from posting parked transfers behind the kill */
+  mutex_lock(&dev->recover_mutex);
+
+  /* Cancel every posted URB, their completions mark them done */
+  usb_kill_anchored_urbs(&dev->bulk_in_anchor);
+
+  /* Nothing is in flight anymore, return the queued transfers to the pool,
+     the parked ones included */
+  spin_lock_irq(&dev->bulk_in_lock);
+  list_splice_init(&dev->bulk_in_queue, &done);
+  spin_unlock_irq(&dev->bulk_in_lock);
+  mutex_unlock(&dev->recover_mutex);
+
+  /* So is the batch waiting to be posted */
+  list_splice_init(&dev->bulk_in_batch, &done);
+  dev->bulk_in_batch_len = 0;
+
+  list_for_each_entry_safe(xfer, tmp, &done, list)
+  {
+    list_del_init(&xfer->list);
+    drv_pool_put(dev, xfer);
+  }
+}
+
+/* Post the nr transfers of a list in batches of drv_irq_batch, where the
+   last URB of a batch on each striped endpoint raises the interrupt.
+   Transfers not posted after a failure go back to the pool */
+static int drv_read_post(struct driver_private *dev, struct list_head *xfers, unsigned int nr)
+{
+  unsigned int batch = drv_irq_batch(max(drv_tune(dev, read_queue_depth), 1U));
+  struct drv_xfer *xfer, *tmp;
+  unsigned int ii = 0;
+  int retval = 0;
+
+  list_for_each_entry_safe(xfer, tmp, xfers, list)
+  {
+    list_del_init(&xfer->list);
+    if(!retval)
+    {
+      /* The URBs of a batch take the pairs in turn, so its last
+         nr_stripes URBs are the last on every endpoint */
+      retval = drv_read_submit(dev, xfer, min(roundup(ii + 1, batch), nr) - ii <= dev->nr_stripes);
+      ii++;
+    }
+    if(retval)
+      drv_pool_put(dev, xfer);
+  }
+
+  /* A batch cut short leaves the URBs posted without an interrupt waiting
+     for one that never comes, unlinking them makes the host controller
+     give them back now */
+  if(retval && (ii - 1) % batch)
+  {
+    usb_unlink_anchored_urbs(&dev->bulk_in_anchor);
+    wake_up_interruptible(&dev->bulk_in_wait);
+  }
+  return retval;
+}
+
+/* Post read_queue_depth pool transfers on the bulk_in endpoint, called with read_mutex held */
+static int drv_read_start(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+  unsigned int ii;
+  int retval;
+  LIST_HEAD(xfers);
+
+  /* Get rid of leftovers of a previous run which ended in an error */
+  drv_read_stop(dev);
+
+  /* Run with fewer URBs if the writers hold part of the pool, they are
+     gathered first so that every batch is posted whole */
+  for(ii = 0; ii < max(drv_tune(dev, read_queue_depth), 1U); ii++)
+  {
+    xfer = drv_pool_get(dev);
+    if(!xfer)
+      break;
+    list_add_tail(&xfer->list, &xfers);
+  }
+
+  /* Not a single transfer was free */
+  if(!ii)
+    return -EBUSY;
+
+  /* Failures of the first transfers are already parked for the recovery */
+  dev->bulk_in_running = true;
+  retval = drv_read_post(dev, &xfers, ii);
+  if(retval)
+  {
+    drv_read_stop(dev);
+    return retval;
+  }
+  return 0;
+}
+
+/* Fetch the oldest posted read transfer without dequeuing it, NULL until it has completed */
+static struct drv_xfer *drv_read_peek(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+
+  spin_lock_irq(&dev->bulk_in_lock);
+  xfer = list_first_entry_or_null(&dev->bulk_in_queue, struct drv_xfer, list);
+  if(xfer && !xfer->done)
+    xfer = NULL;
+  spin_unlock_irq(&dev->bulk_in_lock);
+  return xfer;
+}
+
+/* Dequeue a consumed read transfer and post it again along with the
+   batch it completes, called with read_mutex held */
+static int drv_read_recycle(struct driver_private *dev, struct drv_xfer *xfer)
+{
+  unsigned int nr;
+  int retval;
+
+  spin_lock_irq(&dev->bulk_in_lock);
+  list_del_init(&xfer->list);
+  spin_unlock_irq(&dev->bulk_in_lock);
+
+  /* Transfers cancelled by a stop or a disconnect go back to the pool */
+  if(!dev->bulk_in_running)
+  {
+    drv_pool_put(dev, xfer);
+    return 0;
+  }
+
+  /* The rest of the engine's URBs keep the endpoints busy meanwhile */
+  list_add_tail(&xfer->list, &dev->bulk_in_batch);
+  if(++dev->bulk_in_batch_len < drv_irq_batch(max(drv_tune(dev, read_queue_depth), 1U)))
+    return 0;
+
+  nr = dev->bulk_in_batch_len;
+  dev->bulk_in_batch_len = 0;
+  retval = drv_read_post(dev, &dev->bulk_in_batch, nr);
+  if(retval)
+    dev->bulk_in_running = false;
+  return retval;
+}
+
+/* Make sure a scatter-gather bounce list exists, called with its lock held */
+static int drv_sg_bounce_get(struct drv_sg_bounce *bounce)
+{
+  /* The bounce list is kept for the lifetime of the device once allocated */
+  if(!bounce->sgl)
+  {
+    bounce->size = PAGE_ALIGN(max_t(size_t, sg_max_size, sg_min_size));
+    bounce->sgl = sgl_alloc(bounce->size, GFP_KERNEL, &bounce->nents);
+    if(!bounce->sgl)
+      return -ENOMEM;
+  }
+  /* A user buffer not starting on a page boundary spans one more page */
+  if(!bounce->pages)
+  {
+    bounce->max_pages = bounce->size / PAGE_SIZE + 1;
+    bounce->pages = kcalloc(bounce->max_pages, sizeof(*bounce->pages), GFP_KERNEL);
+    bounce->direct = kcalloc(bounce->max_pages, sizeof(*bounce->direct), GFP_KERNEL);
+    if(!bounce->pages || !bounce->direct)
+    {
+      kfree(bounce->pages);
+      kfree(bounce->direct);
+      bounce->pages = NULL;
+      bounce->direct = NULL;
+      return -ENOMEM;
+    }
+  }
+  return 0;
+}
+
+/* Gather len bytes of the caller's payload into the bounce pages, called with its lock held */
+static int drv_sg_fill(struct drv_sg_bounce *bounce, struct iov_iter *iter, size_t len)
+{
+  struct scatterlist *sg;
+  size_t done = 0, step;
+  int ii;
+
+  for_each_sg(bounce->sgl, sg, DIV_ROUND_UP(len, PAGE_SIZE), ii)
+  {
+    step = min_t(size_t, sg->length, len - done);
+    if(copy_page_from_iter(sg_page(sg), sg->offset, step, iter) != step)
+    {
+      iov_iter_revert(iter, done);
+      return -EFAULT;
+    }
+    done += step;
+  }
+  return 0;
+}
+
+/* Scatter len received bytes from the bounce pages to the caller, called with its lock held */
+static ssize_t drv_sg_drain(struct drv_sg_bounce *bounce, struct iov_iter *iter, size_t len)
+{
+  struct scatterlist *sg;
+  size_t done = 0, step, copied;
+  int ii;
+
+  for_each_sg(bounce->sgl, sg, DIV_ROUND_UP(len, PAGE_SIZE), ii)
+  {
+    step = min_t(size_t, sg->length, len - done);
+    copied = copy_page_to_iter(sg_page(sg), sg->offset, step, iter);
+    done += copied;
+    if(copied != step)
+      return done ? done : -EFAULT;
+  }
+  return done;
+}
+
+/* Move up to len bytes straight between the caller's pages and the device,
+   one scatter-gather request per user segment until a short transfer.
+   Called with the bounce lock held, -EOPNOTSUPP leaves the transfer to
+   the bounce list */
+static ssize_t drv_sg_direct(struct driver_private *dev, struct drv_sg_bounce *bounce,
+                             struct iov_iter *iter, size_t len, unsigned int pipe, bool is_read)
+{
+  unsigned int maxp = usb_maxpacket(dev->usb_dev, pipe);
+  struct usb_sg_request io;
+  struct scatterlist *sg;
+  size_t done = 0, offset, step, pos;
+  unsigned int nents;
+  ssize_t got;
+  int ii;
+
+  /* Every entry but the last of a list must be a multiple of the max
+     packet size, which aligned segments give on any controller */
+  if(!READ_ONCE(direct_io) || !user_backed_iter(iter) || !maxp || len < maxp ||
+     (iov_iter_alignment(iter) & (maxp - 1)))
+    return -EOPNOTSUPP;
+  len = rounddown(len, maxp);
+
+  while(done < len)
+  {
+    /* Pin the pages of the current segment, the device writes into them on reads */
+    got = iov_iter_extract_pages(iter, &bounce->pages, len - done, bounce->max_pages, 0, &offset);
+    if(got <= 0)
+      break;
+    nents = DIV_ROUND_UP(offset + got, PAGE_SIZE);
+
+    /* Describe them as a list, the first entry starts at the buffer's offset */
+    sg_init_table(bounce->direct, nents);
+    pos = 0;
+    for_each_sg(bounce->direct, sg, nents, ii)
+    {
+      step = min_t(size_t, PAGE_SIZE - offset, got - pos);
+      sg_set_page(sg, bounce->pages[ii], step, offset);
+      offset = 0;
+      pos += step;
+    }
+
+    if(usb_sg_init(&io, dev->usb_dev, pipe, 0, bounce->direct, nents, got, GFP_KERNEL) < 0)
+    {
+      iov_iter_revert(iter, got);
+      unpin_user_pages(bounce->pages, nents);
+      break;
+    }
+    usb_sg_wait(&io);
+    unpin_user_pages_dirty_lock(bounce->pages, nents, is_read);
+
+    if(io.status && io.status != -EREMOTEIO)
+      dev_err(&dev->usb_intf->dev,"%s - Direct transfer failed, error %d\n",__func__, io.status);
+
+    /* Give back what the device did not fill or take */
+    iov_iter_revert(iter, got - io.bytes);
+    done += io.bytes;
+    if(io.bytes < got)
+    {
+      /* A failure without data is reported, a short transfer is not */
+      if(!done && io.status && io.status != -EREMOTEIO)
+        return (io.status == -EPIPE) ? -EPIPE : -EIO;
+      return done;
+    }
+  }
+
+  /* Nothing could be pinned, the bounce list may still reach the buffer */
+  return done ? done : -EOPNOTSUPP;
+}
+
+/* Move one large transfer through the scatter-gather bounce list, the host
+   controller gets the whole list as a single request when it supports it.
+   Aligned user buffers skip the bounce list and its copy */
+static ssize_t drv_sg_transfer(struct driver_private *dev, struct iov_iter *iter, size_t len, bool is_read)
+{
+  struct drv_sg_bounce *bounce = &dev->sg_bounce[is_read ? DRV_STAT_READ : DRV_STAT_WRITE];
+  struct usb_sg_request io;
+  unsigned int pipe;
+  ssize_t retval;
+
+  retval = mutex_lock_interruptible(&bounce->lock);
+  if(retval < 0)
+    return retval;
+
+  retval = drv_sg_bounce_get(bounce);
+  if(retval < 0)
+    goto exit;
+  len = min(len, bounce->size);
+
+  pipe = is_read ? usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr) :
+                   usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr);
+  retval = drv_sg_direct(dev, bounce, iter, len, pipe, is_read);
+  if(retval != -EOPNOTSUPP)
+    goto exit;
+
+  if(!is_read)
+  {
+    retval = drv_sg_fill(bounce, iter, len);
+    if(retval < 0)
+      goto exit;
+  }
+
+  /* Build the URBs, usb_sg_wait() submits them and waits for the result */
+  retval = usb_sg_init(&io, dev->usb_dev, pipe, 0, bounce->sgl, DIV_ROUND_UP(len, PAGE_SIZE), len, GFP_KERNEL);
+  if(retval < 0)
+  {
+    if(!is_read)
+      iov_iter_revert(iter, len);
+    goto exit;
+  }
+  usb_sg_wait(&io);
+
+  if(io.status && io.status != -EREMOTEIO)
+    dev_err(&dev->usb_intf->dev,"%s - Scatter-gather transfer failed, error %d\n",__func__, io.status);
+
+  if(is_read)
+  {
+    /* Scatter the received data into the reader's buffers */
+    retval = drv_sg_drain(bounce, iter, io.bytes);
+    if(retval < 0 || (size_t)retval < io.bytes)
+      goto exit;
+  }
+  else
+  {
+    /* Give back what the device did not take */
+    iov_iter_revert(iter, len - io.bytes);
+  }
+
+  /* A short read is not an error, a failure without data is */
+  if(io.bytes || !io.status || io.status == -EREMOTEIO)
+    retval = io.bytes;
+  else
+    retval = (io.status == -EPIPE) ? -EPIPE : -EIO;
+exit:
+  mutex_unlock(&bounce->lock);
+  return retval;
+}
+
+/* Finish an asynchronous read, the user pages can only be dirtied in process context */
+static void drv_aio_read_work(struct work_struct *work)
+{
+  struct drv_xfer *xfer = container_of(work, struct drv_xfer, aio_work);
+  struct driver_private *dev = xfer->dev;
+  struct kiocb *iocb = xfer->iocb;
+  struct urb *urb = xfer->urb;
+  size_t len, done = 0, step;
+  size_t offset = xfer->page_offset;
+  unsigned int ii;
+  long res;
+
+  if(urb->status)
+  {
+    res = (urb->status == -EPIPE) ? -EPIPE : -EIO;
+  }
+  else
+  {
+    /* Scatter the received data into the pinned user pages */
+    len = min_t(size_t, urb->actual_length, xfer->aio_len);
+    for(ii = 0; ii < xfer->nr_pages && done < len; ii++)
+    {
+      step = min_t(size_t, PAGE_SIZE - offset, len - done);
+      memcpy_to_page(xfer->pages[ii], offset, xfer->buffer + done, step);
+      done += step;
+      offset = 0;
+    }
+    res = done;
+  }
+
+  /* Release the user pages */
+  for(ii = 0; ii < xfer->nr_pages; ii++)
+  {
+    if(res > 0)
+      set_page_dirty_lock(xfer->pages[ii]);
+    put_page(xfer->pages[ii]);
+  }
+  xfer->nr_pages = 0;
+  xfer->iocb = NULL;
+
+  /* Return the URB and its buffer to the pool */
+  drv_pool_put(dev, xfer);
+
+  iocb->ki_complete(iocb, res);
+}
+
+/* Called when an asynchronous read URB is completed */
+static void drv_aio_read_callback(struct urb *urb)
+{
+  struct drv_xfer *xfer;
+
+  /* Restore transfer from URB */
+  xfer = urb->context;
+  drv_urb_complete(xfer->dev, urb, &xfer->stamp);
+
+  /* Check status of the URB transaction */
+  if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+    dev_err(&xfer->dev->usb_intf->dev,"%s - nonzero read bulk status received: %d\n",__func__, urb->status);
+
+  /* Copying into user pages is left to process context */
+  schedule_work(&xfer->aio_work);
+}
+
+/* Queue an asynchronous read straight onto the bulk_in endpoint, called with read_mutex held */
+static ssize_t drv_aio_read(struct driver_private *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+  struct drv_bulk_ep *ep;
+  struct drv_xfer *xfer;
+  size_t start;
+  ssize_t len;
+  int retval;
+
+  /* Asynchronous readers never sleep for a buffer */
+  xfer = drv_pool_get(dev);
+  if(!xfer)
+    return -EAGAIN;
+
+  /* Pin the pages the data will be copied to, at most one pool buffer */
+  len = iov_iter_get_pages2(to, xfer->pages, dev->pool_buffer_size, dev->pool_buffer_size / PAGE_SIZE + 2, &start);
+  if(len <= 0)
+  {
+    drv_pool_put(dev, xfer);
+    return len ? len : -EFAULT;
+  }
+  xfer->nr_pages = DIV_ROUND_UP(start + len, PAGE_SIZE);
+  xfer->page_offset = start;
+  xfer->aio_len = len;
+  xfer->iocb = iocb;
+
+  /* Read whole packets, the buffer is sized in whole packets as well */
+  ep = drv_stripe_ep(dev, DRV_STAT_READ);
+  usb_fill_bulk_urb(xfer->urb, dev->usb_dev, ep->pipe,
+                    xfer->buffer, roundup(len, ep->max_size),
+                    drv_aio_read_callback, xfer);
+  usb_anchor_urb(xfer->urb, &dev->aio_in_anchor);
+
+  drv_urb_submit(dev, xfer->urb, &xfer->stamp);
+  retval = usb_submit_urb(xfer->urb, GFP_KERNEL);
+  if(retval < 0)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Failed submitting read urb, error %d\n",__func__, retval);
+    drv_urb_submit_failed(dev, xfer->urb, &xfer->stamp, retval);
+    usb_unanchor_urb(xfer->urb);
+    iov_iter_revert(to, len);
+    while(xfer->nr_pages)
+      put_page(xfer->pages[--xfer->nr_pages]);
+    xfer->iocb = NULL;
+    drv_pool_put(dev, xfer);
+    return retval;
+  }
+  return -EIOCBQUEUED;
+}
+
+/* Pick the call of a direction to dispatch next, called with sched_lock
+   held. Real-time calls go first, then the lowest virtual start, calls of
+   handles held back by their caps are skipped and *wait_ns tells how long
+   until the first of them may go */
+static struct drv_sched_req *drv_sched_pick(struct driver_private *dev, int dir, u64 *wait_ns)
+{
+  struct drv_sched_req *req, *best = NULL;
+  u64 now = ktime_get_ns();
+  bool rt, best_rt = false;
+
+  *wait_ns = 0;
+  list_for_each_entry(req, &dev->sched_queue[dir], list)
+  {
+    if(req->ctx->cap_next_ns > now)
+    {
+      if(!*wait_ns || req->ctx->cap_next_ns - now < *wait_ns)
+        *wait_ns = req->ctx->cap_next_ns - now;
+      continue;
+    }
+    rt = req->ctx->qos.prio_class == STORAGE_QOS_CLASS_RT;
+    if(!best || (rt && !best_rt) || (rt == best_rt && req->vstart < best->vstart))
+    {
+      best = req;
+      best_rt = rt;
+    }
+  }
+  return best;
+}
+
+/* Check whether a waiting call is the one to dispatch now */
+static bool drv_sched_ready(struct driver_private *dev, struct drv_sched_req *req, int dir)
+{
+  u64 wait_ns;
+  bool ready;
+
+  spin_lock(&dev->sched_lock);
+  ready = !dev->sched_busy[dir] && drv_sched_pick(dev, dir, &wait_ns) == req;
+  spin_unlock(&dev->sched_lock);
+  return ready;
+}
+
+/* Dispatch a waiting call if it is its turn, otherwise *wait_ns tells how
+   long until a cap expires, 0 to wait for the call in service */
+static bool drv_sched_try(struct driver_private *dev, struct drv_sched_req *req, int dir, u64 *wait_ns)
+{
+  bool granted = false;
+
+  spin_lock(&dev->sched_lock);
+  if(drv_sched_pick(dev, dir, wait_ns) == req && !dev->sched_busy[dir])
+  {
+    list_del_init(&req->list);
+    dev->sched_busy[dir] = true;
+    dev->sched_vtime[dir] = req->vstart;
+    granted = true;
+  }
+  else if(dev->sched_busy[dir])
+  {
+    *wait_ns = 0;
+  }
+  spin_unlock(&dev->sched_lock);
+  return granted;
+}
+
+/* Wait for the turn of a raw read or write call of ctx, calls of one
+   direction are dispatched one at a time in start-time fair queuing order */
+static int drv_sched_enter(struct driver_private *dev, struct drv_file *ctx, int dir, bool nonblock)
+{
+  struct drv_sched_req req = { .ctx = ctx };
+  u64 wait_ns;
+  long retval;
+
+  /* A handle back from idling starts at the current virtual time, it
+     gets no credit for the time it did not use the device */
+  spin_lock(&dev->sched_lock);
+  req.vstart = max(dev->sched_vtime[dir], ctx->vfinish[dir]);
+  list_add_tail(&req.list, &dev->sched_queue[dir]);
+  spin_unlock(&dev->sched_lock);
+
+  while(!drv_sched_try(dev, &req, dir, &wait_ns))
+  {
+    if(nonblock)
+    {
+      retval = -EAGAIN;
+      goto dequeue;
+    }
+    if(dev->disconnected)
+    {
+      retval = -ENODEV;
+      goto dequeue;
+    }
+    retval = wait_event_interruptible_timeout(dev->sched_wait,
+                                              drv_sched_ready(dev, &req, dir) || dev->disconnected,
+                                              wait_ns ? nsecs_to_jiffies(wait_ns) + 1 : MAX_SCHEDULE_TIMEOUT);
+    if(retval < 0)
+      goto dequeue;
+  }
+  return 0;
+
+dequeue:
+  spin_lock(&dev->sched_lock);
+  list_del(&req.list);
+  spin_unlock(&dev->sched_lock);
+  /* Another call may be the one to go now */
+  wake_up_all(&dev->sched_wait);
+  return retval;
+}
+
+/* End the dispatch of a call which moved bytes, its handle is charged
+   bytes scaled by its weight in virtual time and the gap its caps ask for */
+static void drv_sched_exit(struct driver_private *dev, struct drv_file *ctx, int dir, size_t bytes)
+{
+  u64 now = ktime_get_ns();
+  u64 gap = 0;
+
+  spin_lock(&dev->sched_lock);
+  ctx->vfinish[dir] = dev->sched_vtime[dir] + div_u64((u64)bytes * DRV_QOS_WEIGHT_MAX, ctx->qos.weight);
+  dev->sched_busy[dir] = false;
+
+  /* Caps hold the handle back as long as its bytes or calls take at the
+     capped rate, unused time is not saved up for later */
+  if(bytes && ctx->qos.rate_bps)
+    gap = div64_u64((u64)bytes * NSEC_PER_SEC, ctx->qos.rate_bps);
+  if(bytes && ctx->qos.iops)
+    gap = max_t(u64, gap, NSEC_PER_SEC / ctx->qos.iops);
+  if(gap)
+    ctx->cap_next_ns = max(ctx->cap_next_ns, now) + gap;
+  spin_unlock(&dev->sched_lock);
+
+  wake_up_all(&dev->sched_wait);
+}
+
+/* Check whether calls of other handles wait for the direction, a long
+   call then returns early so that its turn stays one transfer long */
+static bool drv_sched_contended(struct driver_private *dev, int dir)
+{
+  bool contended;
+
+  spin_lock(&dev->sched_lock);
+  contended = !list_empty(&dev->sched_queue[dir]);
+  spin_unlock(&dev->sched_lock);
+  return contended;
+}
+
+/* Set the scheduling class, weight and caps of a handle */
+static int drv_sched_set_qos(struct driver_private *dev, struct drv_file *ctx, const struct storage_qos *qos)
+{
+  if(qos->prio_class > STORAGE_QOS_CLASS_RT || qos->weight > DRV_QOS_WEIGHT_MAX || qos->resv)
+    return -EINVAL;
+  /* Like the real-time I/O priority class, it could starve everybody else */
+  if(qos->prio_class == STORAGE_QOS_CLASS_RT && !capable(CAP_SYS_NICE))
+    return -EPERM;
+
+  spin_lock(&dev->sched_lock);
+  ctx->qos = *qos;
+  if(!ctx->qos.weight)
+    ctx->qos.weight = DRV_QOS_WEIGHT_DEFAULT;
+  /* Lifted or loosened caps apply right away */
+  ctx->cap_next_ns = 0;
+  spin_unlock(&dev->sched_lock);
+
+  wake_up_all(&dev->sched_wait);
+  return 0;
+}
+
+static ssize_t drv_read_raw(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct driver_private *dev;
+  struct drv_xfer *xfer;
+  size_t count = iov_iter_count(to);
+  size_t copied = 0;
+  size_t chunk;
+  ssize_t bytes;
+  bool nowait, nonblock;
+  int status;
+  int retval = 0;
+
+  /* Restore driver private structure from the file handle */
+  dev = ((struct drv_file *)iocb->ki_filp->private_data)->dev;
+  nowait = iocb->ki_flags & IOCB_NOWAIT;
+  nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK);
+  trace_usbflash_read(dev->usb_intf->minor, count, nonblock, !is_sync_kiocb(iocb));
+
+  /* If we cannot read at all, return EOF */
+  if(!count)
+    return 0;
+  /* The bulk pair of raw transfers is gone or owned by the block device */
+  retval = drv_raw_usable(dev);
+  if(retval < 0)
+    return retval;
+
+  /* Only one reader drains the completed transfers at a time, the others
+     wait in line, writers go on meanwhile */
+  if(nonblock)
+  {
+    if(!mutex_trylock(&dev->read_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    retval = mutex_lock_interruptible(&dev->read_mutex);
+    if(retval < 0)
+      return retval;
+  }
+
+  if(dev->disconnected)
+  {
+    retval = -ENODEV;
+    goto exit;
+  }
+
+  /* Asynchronous reads go straight to the endpoint unless a synchronous
+     reader has armed the read engine, then they are served from it */
+  if(!is_sync_kiocb(iocb) && !dev->bulk_in_running && !drv_read_peek(dev))
+  {
+    retval = drv_aio_read(dev, iocb, to);
+    goto exit;
+  }
+
+  /* IOCB_NOWAIT callers only get data which has already arrived */
+  if(nowait && !drv_read_peek(dev))
+  {
+    retval = -EAGAIN;
+    goto exit;
+  }
+
+  /* Large reads bypass an idle read engine and go out as one scatter-gather
+     request, rounded down to whole packets so that the device cannot babble.
+     Striped and stream-tagged reads stay on the engine */
+  if(!nonblock && !dev->bulk_in_running && !drv_read_peek(dev) && count >= sg_min_size && drv_sg_usable(dev))
+  {
+    while(copied < count)
+    {
+      chunk = rounddown(count - copied, dev->bulk_in_max_size);
+      if(!chunk)
+        break;
+      bytes = drv_sg_transfer(dev, to, chunk, true);
+      if(bytes < 0)
+      {
+        retval = bytes;
+        break;
+      }
+      copied += bytes;
+      /* A short read ends the transfer, so do readers waiting for their turn */
+      if(bytes < min_t(size_t, chunk, dev->sg_bounce[DRV_STAT_READ].size) ||
+         drv_sched_contended(dev, DRV_STAT_READ))
+        break;
+    }
+    goto done;
+  }
+
+  /* Start the read engine on first use or after it stopped on an error */
+  if(!dev->bulk_in_running)
+  {
+    retval = drv_read_start(dev);
+    if(retval < 0)
+      goto exit;
+  }
+
+  /* Non-blocking readers leave the engine armed and come back on poll */
+  if(nonblock && !drv_read_peek(dev))
+  {
+    retval = -EAGAIN;
+    goto exit;
+  }
+
+  /* Wait for the oldest posted transfer to complete */
+  retval = wait_event_interruptible(dev->bulk_in_wait, drv_read_peek(dev) || dev->disconnected);
+  if(retval < 0)
+    goto exit;
+  if(!drv_read_peek(dev))
+  {
+    retval = -ENODEV;
+    goto exit;
+  }
+
+  /* Serve the reader from every transfer that has completed so far */
+  while(copied < count && (xfer = drv_read_peek(dev)))
+  {
+    status = xfer->status;
+    if(status)
+    {
+      /* Report the error unless data was already handed out by this call */
+      if(!copied)
+        retval = (status == -EPIPE) ? -EPIPE : -EIO;
+      /* Cancelled transfers mean the engine is going down */
+      if(status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)
+        dev->bulk_in_running = false;
+      drv_read_recycle(dev, xfer);
+      break;
+    }
+
+    /* Copy data read to user buffer */
+    chunk = min(count - copied, (size_t)xfer->urb->actual_length - xfer->offset);
+    if(copy_to_iter(xfer->buffer + xfer->offset, chunk, to) != chunk)
+    {
+      retval = -EFAULT;
+      break;
+    }
+    xfer->offset += chunk;
+    copied += chunk;
+
+    /* A fully consumed transfer goes straight back to the endpoint */
+    if(xfer->offset == xfer->urb->actual_length)
+    {
+      retval = drv_read_recycle(dev, xfer);
+      if(retval < 0)
+        break;
+    }
+  }
+
+done:
+  /* Return the number of bytes read if any, otherwise the error */
+  if(copied)
+    retval = copied;
+exit:
+  mutex_unlock(&dev->read_mutex);
+  return retval;
+}
+
+/* Raw reads are dispatched by the scheduler, one call of a handle at a time */
+static ssize_t drv_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct drv_file *ctx = iocb->ki_filp->private_data;
+  bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+  size_t count = iov_iter_count(to);
+  ssize_t retval;
+
+  if(!count)
+    return 0;
+  retval = drv_sched_enter(ctx->dev, ctx, DRV_STAT_READ, nonblock);
+  if(retval < 0)
+    return retval;
+  retval = drv_read_raw(iocb, to);
+  /* Asynchronous reads are charged for what they took from the iterator */
+  drv_sched_exit(ctx->dev, ctx, DRV_STAT_READ, count - iov_iter_count(to));
+  return retval;
+}
+
+/* Free a file handle once it is released and its last write has completed */
+static void drv_file_free(struct kref *kref)
+{
+  kfree(container_of(kref, struct drv_file, kref));
+}
+
+/* Finish a write for good, from its completion or when the recovery gives up on it */
+static void drv_write_finish(struct driver_private *dev, struct drv_xfer *xfer, int status)
+{
+  struct drv_file *owner;
+  struct kiocb *iocb;
+  unsigned long flags;
+  long res = 0;
+
+  /* Saved for the next write, flush or fsync of the writing handle to
+     report, asynchronous writers get the error through their own request */
+  if(status && !xfer->iocb)
+  {
+    spin_lock_irqsave(&dev->bulk_out_lock, flags);
+    if(xfer->owner)
+      xfer->owner->write_error = status;
+    else
+      dev->bulk_out_errors = status;
+    spin_unlock_irqrestore(&dev->bulk_out_lock, flags);
+  }
+
+  /* Finish the asynchronous request this URB belonged to */
+  iocb = xfer->iocb;
+  xfer->iocb = NULL;
+  if(iocb)
+  {
+    if(status)
+      res = (status == -EPIPE) ? -EPIPE : -EIO;
+    else
+      res = xfer->sent;
+  }
+
+  /* Let the next writer submit, the pool wakes up writers and pollers */
+  atomic_dec(&dev->bulk_out_inflight);
+  up(&dev->bulk_out_limit);
+
+  /* Return the URB and its buffer to the pool */
+  owner = xfer->owner;
+  xfer->owner = NULL;
+  drv_pool_put(dev, xfer);
+
+  if(iocb)
+    iocb->ki_complete(iocb, res);
+  /* The handle may have been released while this write was in flight */
+  if(owner)
+    kref_put(&owner->kref, drv_file_free);
+}
+
+/* Called when the submitted URB transfer is completed */
+static void drv_write_bulk_callback(struct urb *urb)
+{
+  struct drv_xfer *xfer;
+  struct driver_private *dev;
+  unsigned long flags;
+  bool cancelled;
+  bool recover;
+
+  /* Restore transfer and driver private structure from URB */
+  xfer = urb->context;
+  dev = xfer->dev;
+  drv_urb_complete(dev, urb, &xfer->stamp);
+
+  /* Check status of the URB transaction */
+  cancelled = urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN;
+  if(urb->status && !cancelled)
+    dev_err(&dev->usb_intf->dev,"%s - Non zero write bulk status received: %d\n",__func__, urb->status);
+
+  /* Writes lost to a link error or cancelled by the recovery are retried
+     from the first byte the device did not take */
+  recover = urb->status && !READ_ONCE(dev->disconnected) &&
+            (drv_urb_recoverable(urb->status) || (cancelled && READ_ONCE(dev->recovering)));
+
+  spin_lock_irqsave(&dev->bulk_out_lock, flags);
+  xfer->sent += urb->actual_length;
+  if(recover && xfer->sent < xfer->len)
+  {
+    /* Keep its place and its in-flight slot, the recovery submits it again */
+    xfer->parked = true;
+    xfer->status = urb->status;
+    spin_unlock_irqrestore(&dev->bulk_out_lock, flags);
+    if(!cancelled)
+      drv_recover_schedule(dev);
+    return;
+  }
+  list_del_init(&xfer->list);
+  spin_unlock_irqrestore(&dev->bulk_out_lock, flags);
+
+  if(!urb->status)
+    WRITE_ONCE(dev->recover_attempts, 0);
+  drv_write_finish(dev, xfer, (recover || !urb->status) ? 0 : urb->status);
+}
+
+/* Fetch and clear the error left behind by a completed write, those of
+   the handle's own writes first, then those of staged data */
+static int drv_write_error(struct driver_private *dev, struct drv_file *ctx)
+{
+  int retval;
+
+  spin_lock_irq(&dev->bulk_out_lock);
+  retval = ctx->write_error;
+  if(retval < 0)
+  {
+    ctx->write_error = 0;
+  }
+  else
+  {
+    retval = dev->bulk_out_errors;
+    if(retval < 0)
+      dev->bulk_out_errors = 0;
+  }
+  spin_unlock_irq(&dev->bulk_out_lock);
+  if(retval < 0)
+    retval = (retval == -EPIPE) ? retval : -EIO;
+  return retval;
+}
+
+/* Wait for the submitted writes to complete, cancel them if they do not */
+static bool drv_write_idle(struct driver_private *dev)
+{
+  unsigned long flags;
+  bool idle;
+
+  spin_lock_irqsave(&dev->bulk_out_lock, flags);
+  idle = list_empty(&dev->bulk_out_queue);
+  spin_unlock_irqrestore(&dev->bulk_out_lock, flags);
+  return idle;
+}
+
+/* Cancel every raw transfer in flight, their completions park them since
+   recovering is set, called with recover_mutex held */
+static void drv_recover_park_all(struct driver_private *dev)
+{
+  WRITE_ONCE(dev->recovering, true);
+  usb_kill_anchored_urbs(&dev->bulk_in_anchor);
+  usb_kill_anchored_urbs(&dev->bulk_out_anchor);
+  WRITE_ONCE(dev->recovering, false);
+}
+
+/* Clear the halt feature of every striped bulk endpoint, which also resets
+   their data toggles on both sides */
+static int drv_recover_clear_halts(struct driver_private *dev)
+{
+  unsigned int dir, ii;
+  int retval = 0;
+  int err;
+
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+  {
+    for(ii = 0; ii < dev->nr_stripes; ii++)
+    {
+      err = usb_clear_halt(dev->usb_dev, dev->bulk_eps[dir][ii].pipe);
+      if(err && !retval)
+        retval = err;
+    }
+  }
+  return retval;
+}
+
+/* Submit one parked transfer again, called under its direction's lock */
+static int drv_recover_submit(struct driver_private *dev, struct drv_xfer *xfer,
+                              struct usb_anchor *anchor)
+{
+  int retval;
+
+  /* Batches are broken up by the recovery, every URB interrupts */
+  xfer->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+  usb_anchor_urb(xfer->urb, anchor);
+  drv_urb_submit(dev, xfer->urb, &xfer->stamp);
+  retval = usb_submit_urb(xfer->urb, GFP_ATOMIC);
+  if(retval)
+  {
+    drv_urb_submit_failed(dev, xfer->urb, &xfer->stamp, retval);
+    usb_unanchor_urb(xfer->urb);
+    return retval;
+  }
+  xfer->parked = false;
+  return 0;
+}
+
+/* Submit the parked transfers again in the order they were first posted,
+   writes resume at the first byte the device did not take. Called with
+   recover_mutex held */
+static void drv_recover_resubmit(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+  struct urb *urb;
+  int retval = 0;
+
+  spin_lock_irq(&dev->bulk_in_lock);
+  list_for_each_entry(xfer, &dev->bulk_in_queue, list)
+  {
+    if(!xfer->parked)
+      continue;
+    retval = drv_recover_submit(dev, xfer, &dev->bulk_in_anchor);
+    if(retval)
+      break;
+  }
+  spin_unlock_irq(&dev->bulk_in_lock);
+
+  spin_lock_irq(&dev->bulk_out_lock);
+  list_for_each_entry(xfer, &dev->bulk_out_queue, list)
+  {
+    if(!xfer->parked || retval)
+      continue;
+    urb = xfer->urb;
+    urb->transfer_buffer = xfer->buffer + xfer->sent;
+    if(urb->transfer_flags & URB_NO_TRANSFER_DMA_MAP)
+      urb->transfer_dma = xfer->dma + xfer->sent;
+    urb->transfer_buffer_length = xfer->len - xfer->sent;
+    retval = drv_recover_submit(dev, xfer, &dev->bulk_out_anchor);
+  }
+  spin_unlock_irq(&dev->bulk_out_lock);
+
+  /* Whatever stayed parked waits for the next attempt */
+  if(retval)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Failed resubmitting urb, error %d\n",__func__, retval);
+    drv_recover_schedule(dev);
+  }
+}
+
+/* Give up on the parked transfers, reads hand their error to the reader
+   and writes complete with it. Called with recover_mutex held */
+static void drv_recover_fail(struct driver_private *dev)
+{
+  struct drv_xfer *xfer, *tmp;
+  LIST_HEAD(failed);
+
+  spin_lock_irq(&dev->bulk_in_lock);
+  list_for_each_entry(xfer, &dev->bulk_in_queue, list)
+  {
+    if(!xfer->parked)
+      continue;
+    xfer->parked = false;
+    xfer->done = true;
+  }
+  spin_unlock_irq(&dev->bulk_in_lock);
+  wake_up_interruptible(&dev->bulk_in_wait);
+
+  spin_lock_irq(&dev->bulk_out_lock);
+  list_for_each_entry_safe(xfer, tmp, &dev->bulk_out_queue, list)
+  {
+    if(xfer->parked)
+      list_move_tail(&xfer->list, &failed);
+  }
+  spin_unlock_irq(&dev->bulk_out_lock);
+
+  list_for_each_entry_safe(xfer, tmp, &failed, list)
+  {
+    list_del_init(&xfer->list);
+    drv_write_finish(dev, xfer, xfer->status);
+  }
+  wake_up(&dev->pool_wait);
+}
+
+/* Check whether any raw transfer waits for the recovery */
+static bool drv_recover_pending(struct driver_private *dev)
+{
+  struct drv_xfer *xfer;
+  bool pending = false;
+
+  spin_lock_irq(&dev->bulk_in_lock);
+  list_for_each_entry(xfer, &dev->bulk_in_queue, list)
+    pending |= xfer->parked;
+  spin_unlock_irq(&dev->bulk_in_lock);
+
+  spin_lock_irq(&dev->bulk_out_lock);
+  list_for_each_entry(xfer, &dev->bulk_out_queue, list)
+    pending |= xfer->parked;
+  spin_unlock_irq(&dev->bulk_out_lock);
+  return pending;
+}
+
+/* Bring the raw transfers back after a stall or a link error: the first
+   attempts clear the halts and resubmit in place, later ones reset the
+   port, and the parked transfers fail once the attempts run out */
+static void drv_recover_work(struct work_struct *work)
+{
+  struct driver_private *dev = container_of(to_delayed_work(work), struct driver_private, recover_work);
+  unsigned int attempt;
+  int retval;
+
+  mutex_lock(&dev->recover_mutex);
+  /* A stop, a drain or a reset may have dealt with the parked transfers already */
+  if(dev->disconnected || !drv_recover_pending(dev))
+    goto exit;
+
+  attempt = ++dev->recover_attempts;
+  if(attempt > DRV_RECOVER_MAX_ATTEMPTS)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Giving up after %u attempts\n",__func__, attempt - 1);
+    drv_recover_fail(dev);
+    dev->recover_attempts = 0;
+    goto exit;
+  }
+
+  /* Everything still in flight sits behind the failed transfer */
+  drv_recover_park_all(dev);
+
+  retval = -EPIPE;
+  if(attempt <= DRV_RECOVER_CLEAR_ATTEMPTS)
+    retval = drv_recover_clear_halts(dev);
+  if(retval)
+  {
+    /* pre_reset and post_reset take over, resubmitting once the port is back */
+    dev_warn(&dev->usb_intf->dev,"Recovery attempt %u resets the device\r\n", attempt);
+    usb_queue_reset_device(dev->usb_intf);
+    goto exit;
+  }
+  drv_recover_resubmit(dev);
+
+exit:
+  mutex_unlock(&dev->recover_mutex);
+}
+
+/* Wait for the writes in flight, parked ones included since recovery
+   sends them again or fails them */
+static int drv_write_drain(struct driver_private *dev)
+{
+  if(!wait_event_timeout(dev->pool_wait, drv_write_idle(dev),
+                         msecs_to_jiffies(DRV_WRITE_DRAIN_TIMEOUT_MS)))
+  {
+    mutex_lock(&dev->recover_mutex);
+    usb_kill_anchored_urbs(&dev->bulk_out_anchor);
+    drv_recover_fail(dev);
+    mutex_unlock(&dev->recover_mutex);
+    return -ETIMEDOUT;
+  }
+  return 0;
+}
+
+/* Send len bytes of a pool transfer out the bulk port, the caller holds an
+   in-flight slot which the completion gives back along with the transfer.
+   Failures are reported to owner, or to any handle when it is NULL */
+static int drv_write_submit(struct driver_private *dev, struct drv_xfer *xfer, size_t len,
+                            struct kiocb *iocb, struct drv_file *owner)
+{
+  int retval;
+
+  /* The device must not go away while the URB is being submitted */
+  mutex_lock(&dev->io_mutex);
+  if(dev->disconnected)
+  {
+    mutex_unlock(&dev->io_mutex);
+    return -ENODEV;
+  }
+
+  /* Initialize URB, taking the next striped pair under io_mutex so that
+     the pairs carry the writes in the order they were submitted */
+  usb_fill_bulk_urb(xfer->urb, dev->usb_dev, drv_stripe_ep(dev, DRV_STAT_WRITE)->pipe,
+                    xfer->buffer, len, drv_write_bulk_callback, xfer);
+  /* A striped transfer shorter than a pool buffer ends in a short packet,
+     which tells the device where the next pair takes over */
+  if(dev->nr_stripes > 1 && len < dev->pool_buffer_size)
+    xfer->urb->transfer_flags |= URB_ZERO_PACKET;
+  xfer->iocb = iocb;
+  xfer->owner = owner;
+  xfer->len = len;
+  xfer->sent = 0;
+  xfer->parked = false;
+  if(owner)
+    kref_get(&owner->kref);
+
+  /* Recovery must not resend the queue while this URB joins it */
+  mutex_lock(&dev->recover_mutex);
+  spin_lock_irq(&dev->bulk_out_lock);
+  list_add_tail(&xfer->list, &dev->bulk_out_queue);
+  spin_unlock_irq(&dev->bulk_out_lock);
+  usb_anchor_urb(xfer->urb, &dev->bulk_out_anchor);
+
+  /* Send the data out the bulk port */
+  drv_urb_submit(dev, xfer->urb, &xfer->stamp);
+  retval = usb_submit_urb(xfer->urb, GFP_KERNEL);
+  if(retval)
+  {
+    spin_lock_irq(&dev->bulk_out_lock);
+    list_del_init(&xfer->list);
+    spin_unlock_irq(&dev->bulk_out_lock);
+  }
+  mutex_unlock(&dev->recover_mutex);
+  mutex_unlock(&dev->io_mutex);
+  if(retval) 
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Failed submitting write urb, error %d\n",__func__, retval);
+    drv_urb_submit_failed(dev, xfer->urb, &xfer->stamp, retval);
+    usb_unanchor_urb(xfer->urb);
+    xfer->iocb = NULL;
+    xfer->owner = NULL;
+    if(owner)
+      kref_put(&owner->kref, drv_file_free);
+  }
+  return retval;
+}
+
+/* Send up to one pool buffer of the payload in an asynchronous URB, an
+   asynchronous request is completed by the URB instead of this call */
+static ssize_t drv_write_one(struct driver_private *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+  struct drv_file *ctx = iocb->ki_filp->private_data;
+  bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+  struct drv_xfer *xfer = NULL;
+  size_t writesize;
+  size_t copied;
+  int retval = 0;
+
+  /* Fill up the number of bytes to write */
+  writesize = min(iov_iter_count(from), dev->pool_buffer_size);
+
+  /* Wait for a free slot so that the in-flight writes stay bounded */
+  if(nowait)
+  {
+    if(down_trylock(&dev->bulk_out_limit))
+      return -EAGAIN;
+  }
+  else
+  {
+    if(down_interruptible(&dev->bulk_out_limit))
+      return -ERESTARTSYS;
+  }
+  atomic_inc(&dev->bulk_out_inflight);
+
+  /* Report the failure of an earlier asynchronous write */
+  retval = drv_write_error(dev, ctx);
+  if(retval < 0)
+    goto error;
+
+  /* Take a preallocated URB and DMA buffer, the read engine may hold some */
+  xfer = drv_pool_get(dev);
+  if(!xfer)
+  {
+    if(nowait)
+    {
+      retval = -EAGAIN;
+      goto error;
+    }
+    retval = wait_event_interruptible(dev->pool_wait, (xfer = drv_pool_get(dev)));
+    if(retval < 0)
+      goto error;
+  }
+
+  /* Write payload(usb device class protocol) into dma buffer */
+  copied = copy_from_iter(xfer->buffer, writesize, from);
+  if(copied != writesize) 
+  {
+    iov_iter_revert(from, copied);
+    retval = -EFAULT;
+    goto error;
+  }
+
+  retval = drv_write_submit(dev, xfer, writesize, is_sync_kiocb(iocb) ? NULL : iocb, ctx);
+  if(retval)
+    goto error_revert;
+
+  /* Return the number of bytes written */
+  return writesize;
+
+error_revert:
+  iov_iter_revert(from, writesize);
+
+error:
+  if(xfer)
+    drv_pool_put(dev, xfer);
+  atomic_dec(&dev->bulk_out_inflight);
+  up(&dev->bulk_out_limit);
+  return retval;
+}
+
+/* Send the staged bytes as one URB, called with wc_mutex held. A failed
+   submission is reported like a failed URB by the next write, flush or fsync */
+static int drv_write_stage_flush(struct driver_private *dev, bool nowait)
+{
+  struct drv_xfer *xfer = dev->wc_xfer;
+  int retval;
+
+  if(!xfer)
+    return 0;
+  if(!dev->wc_len)
+    goto release;
+
+  /* Staged data takes an in-flight slot like any other write */
+  if(nowait)
+  {
+    if(down_trylock(&dev->bulk_out_limit))
+      return -EAGAIN;
+  }
+  else
+  {
+    if(down_interruptible(&dev->bulk_out_limit))
+      return -ERESTARTSYS;
+  }
+  atomic_inc(&dev->bulk_out_inflight);
+
+  retval = drv_write_submit(dev, xfer, dev->wc_len, NULL, NULL);
+  if(!retval)
+  {
+    dev->wc_xfer = NULL;
+    dev->wc_len = 0;
+    return 0;
+  }
+  atomic_dec(&dev->bulk_out_inflight);
+  up(&dev->bulk_out_limit);
+
+  spin_lock_irq(&dev->bulk_out_lock);
+  dev->bulk_out_errors = retval;
+  spin_unlock_irq(&dev->bulk_out_lock);
+
+release:
+  dev->wc_xfer = NULL;
+  dev->wc_len = 0;
+  drv_pool_put(dev, xfer);
+  return 0;
+}
+
+/* Send whatever is staged, so that a write bypassing the stage keeps its order */
+static int drv_write_unstage(struct driver_private *dev, bool nowait)
+{
+  int retval;
+
+  if(!READ_ONCE(dev->wc_xfer))
+    return 0;
+  if(nowait)
+  {
+    if(!mutex_trylock(&dev->wc_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    retval = mutex_lock_interruptible(&dev->wc_mutex);
+    if(retval < 0)
+      return retval;
+  }
+  retval = drv_write_stage_flush(dev, nowait);
+  mutex_unlock(&dev->wc_mutex);
+  return retval;
+}
+
+/* Runs write_combine_ms after data was first staged */
+static void drv_write_stage_work(struct work_struct *work)
+{
+  struct driver_private *dev = container_of(to_delayed_work(work), struct driver_private, wc_work);
+
+  mutex_lock(&dev->wc_mutex);
+  drv_write_stage_flush(dev, false);
+  mutex_unlock(&dev->wc_mutex);
+}
+
+/* Append a small write to the stage, which goes out as one URB once it fills
+   a pool buffer, write_combine_ms after its first byte, or on fsync and close */
+static ssize_t drv_write_stage(struct driver_private *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+  struct drv_file *ctx = iocb->ki_filp->private_data;
+  bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+  struct drv_xfer *xfer;
+  size_t len;
+  size_t copied;
+  ssize_t retval;
+
+  if(nowait)
+  {
+    if(!mutex_trylock(&dev->wc_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    retval = mutex_lock_interruptible(&dev->wc_mutex);
+    if(retval < 0)
+      return retval;
+  }
+
+  /* Report the failure of an earlier write before accepting more data */
+  retval = drv_write_error(dev, ctx);
+  if(retval < 0)
+    goto exit;
+
+  /* A full stage left behind by a non-blocking writer goes first */
+  if(dev->wc_xfer && dev->wc_len == dev->pool_buffer_size)
+  {
+    retval = drv_write_stage_flush(dev, nowait);
+    if(retval < 0)
+      goto exit;
+  }
+
+  if(!dev->wc_xfer)
+  {
+    xfer = drv_pool_get(dev);
+    if(!xfer)
+    {
+      if(nowait)
+      {
+        retval = -EAGAIN;
+        goto exit;
+      }
+      retval = wait_event_interruptible(dev->pool_wait, (xfer = drv_pool_get(dev)));
+      if(retval < 0)
+        goto exit;
+    }
+    dev->wc_xfer = xfer;
+    dev->wc_len = 0;
+    /* The timeout runs from the first byte staged */
+    mod_delayed_work(system_wq, &dev->wc_work, msecs_to_jiffies(write_combine_ms));
+  }
+
+  len = min(iov_iter_count(from), dev->pool_buffer_size - dev->wc_len);
+  copied = copy_from_iter(dev->wc_xfer->buffer + dev->wc_len, len, from);
+  if(copied != len)
+  {
+    iov_iter_revert(from, copied);
+    retval = -EFAULT;
+    goto exit;
+  }
+  dev->wc_len += len;
+  retval = len;
+
+  /* A full stage goes out right away, or with the next write if that would block */
+  if(dev->wc_len == dev->pool_buffer_size)
+    drv_write_stage_flush(dev, nowait);
+
+exit:
+  mutex_unlock(&dev->wc_mutex);
+  return retval;
+}
+
+static ssize_t drv_write_raw(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct driver_private *dev;
+  struct file *file = iocb->ki_filp;
+  struct drv_file *ctx = file->private_data;
+  size_t count = iov_iter_count(from);
+  size_t written = 0;
+  ssize_t bytes = 0;
+  bool nowait = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+  /* Restore driver private structure from the file handle */
+  dev = ctx->dev;
+  trace_usbflash_write(dev->usb_intf->minor, count, nowait, !is_sync_kiocb(iocb));
+
+  /* Verify that we actually have some data to write */
+  if(count == 0)
+    return 0;
+  /* The bulk pair of raw transfers is gone or owned by the block device */
+  bytes = drv_raw_usable(dev);
+  if(bytes < 0)
+    return bytes;
+
+  /* Writers take turns so that their payloads do not interleave, readers go on meanwhile */
+  if(nowait)
+  {
+    if(!mutex_trylock(&dev->write_mutex))
+      return -EAGAIN;
+  }
+  else
+  {
+    bytes = mutex_lock_interruptible(&dev->write_mutex);
+    if(bytes < 0)
+      return bytes;
+  }
+
+  /* An asynchronous write is one pool buffer completed by its URB, a short
+     count tells the submitter to queue the rest as further requests */
+  if(!is_sync_kiocb(iocb))
+  {
+    bytes = drv_write_unstage(dev, nowait);
+    if(!bytes)
+      bytes = drv_write_one(dev, iocb, from);
+    mutex_unlock(&dev->write_mutex);
+    return (bytes < 0) ? bytes : -EIOCBQUEUED;
+  }
+
+  while(written < count)
+  {
+    if(count - written >= sg_min_size && drv_sg_usable(dev))
+    {
+      /* Large writes go out as one scatter-gather request, queued on the
+         endpoint behind the staged and asynchronous writes before them */
+      bytes = drv_write_unstage(dev, false);
+      if(!bytes)
+        bytes = drv_write_error(dev, ctx);
+      if(!bytes)
+        bytes = drv_sg_transfer(dev, from, count - written, false);
+    }
+    else if(write_combine && count - written < sg_min_size)
+    {
+      /* Small writes are gathered into full pool buffers */
+      bytes = drv_write_stage(dev, iocb, from);
+    }
+    else
+    {
+      /* Small writes complete asynchronously from the pool, behind data
+         staged before write_combine was turned off. Large writes of striped
+         pairs or streams go the same way, one pool buffer at a time */
+      bytes = drv_write_unstage(dev, nowait);
+      if(!bytes)
+        bytes = drv_write_one(dev, iocb, from);
+    }
+    if(bytes <= 0)
+      break;
+    written += bytes;
+    /* Writers waiting for their turn get it after this part */
+    if(drv_sched_contended(dev, DRV_STAT_WRITE))
+      break;
+  }
+  mutex_unlock(&dev->write_mutex);
+
+  /* Return the number of bytes written if any, otherwise the error */
+  return written ? written : bytes;
+}
+
+/* Raw writes are dispatched by the scheduler, one call of a handle at a time */
+static ssize_t drv_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct drv_file *ctx = iocb->ki_filp->private_data;
+  bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+  size_t count = iov_iter_count(from);
+  ssize_t retval;
+
+  if(!count)
+    return 0;
+  retval = drv_sched_enter(ctx->dev, ctx, DRV_STAT_WRITE, nowait);
+  if(retval < 0)
+    return retval;
+  retval = drv_write_raw(iocb, from);
+  /* Asynchronous and staged writes are charged for what they took from the iterator */
+  drv_sched_exit(ctx->dev, ctx, DRV_STAT_WRITE, count - iov_iter_count(from));
+  return retval;
+}
+
+static __poll_t drv_poll(struct file *file, poll_table *wait)
+{
+  struct drv_file *ctx = file->private_data;
+  struct driver_private *dev;
+  __poll_t mask = 0;
+
+  /* Restore driver private structure from the file handle */
+  dev = ctx->dev;
+
+  poll_wait(file, &dev->bulk_in_wait, wait);
+  poll_wait(file, &dev->pool_wait, wait);
+
+  if(dev->disconnected)
+    return EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR;
+  /* Reads and writes fail at once, the read engine must not be armed */
+  if(drv_raw_usable(dev))
+    return EPOLLIN | EPOLLOUT | EPOLLERR;
+
+  /* Arm the read engine so that readiness can be reported at all, a busy
+     read_mutex means a reader is already draining it */
+  if(!dev->bulk_in_running && mutex_trylock(&dev->read_mutex))
+  {
+    if(!dev->disconnected && !dev->bulk_in_running)
+      drv_read_start(dev);
+    mutex_unlock(&dev->read_mutex);
+  }
+
+  /* Completed transfers, failed ones included, are ready to be read */
+  if(drv_read_peek(dev))
+    mask |= EPOLLIN | EPOLLRDNORM;
+
+  /* A write would find both an in-flight slot and a pool buffer */
+  if(atomic_read(&dev->bulk_out_inflight) < max(drv_tune(dev, write_queue_depth), 1U) && drv_pool_available(dev))
+    mask |= EPOLLOUT | EPOLLWRNORM;
+
+  /* A write of this handle or staged data failed and has not been reported yet */
+  if(READ_ONCE(ctx->write_error) || READ_ONCE(dev->bulk_out_errors))
+    mask |= EPOLLERR;
+
+  return mask;
+}
+
+/* Called on every close of a file handle */
+static int drv_flush(struct file *file, fl_owner_t id)
+{
+  struct drv_file *ctx = file->private_data;
+  struct driver_private *dev;
+  int retval;
+
+  /* Restore driver private structure from the file handle */
+  if(NULL == ctx)
+    return -ENODEV;
+  dev = ctx->dev;
+
+  /* Send the staged bytes, then wait for every write in flight on the
+     device to complete, those of other handles included since staged
+     bytes carry no owner. The writes of this closer are among them */
+  retval = drv_write_unstage(dev, false);
+  if(retval < 0)
+    return retval;
+  retval = drv_write_drain(dev);
+  if(retval < 0)
+    return retval;
+
+  /* Report the failure of an asynchronous write */
+  return drv_write_error(dev, ctx);
+}
+
+static int drv_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+  return drv_flush(file, NULL);
+}
+
+/* Release the transfer ring, none of its URBs may be in flight */
+static void drv_ring_free(struct driver_private *dev, struct drv_ring *ring)
+{
+  unsigned int ii;
+
+  if(ring->reqs)
+  {
+    for(ii = 0; ii < ring->nr_buffers; ii++)
+      usb_free_urb(ring->reqs[ii].urb);
+    kfree(ring->reqs);
+  }
+  if(ring->buffers)
+    usb_free_coherent(dev->usb_dev, ring->buffers_bytes, ring->buffers, ring->buffers_dma);
+  vfree(ring->hdr);
+  kfree(ring);
+}
+
+/* Cancel the transfers of the ring and release it, called with ring_mutex held */
+static void drv_ring_destroy(struct driver_private *dev)
+{
+  if(!dev->ring)
+    return;
+
+  usb_kill_anchored_urbs(&dev->ring->anchor);
+  drv_ring_free(dev, dev->ring);
+  dev->ring = NULL;
+}
+
+/* Allocate queues, buffers and URBs of the ring, called with ring_mutex held */
+static int drv_ring_setup(struct driver_private *dev, struct storage_ring_params *params)
+{
+  struct drv_ring *ring;
+  size_t sq_off, cq_off;
+  unsigned int ii;
+  int retval;
+
+  /* Ring transfers use the raw bulk pair, which UAS replaced or the block device owns */
+  retval = drv_raw_usable(dev);
+  if(retval < 0)
+    return retval;
+
+  /* Validate the geometry requested by the application */
+  if(!params->nr_entries || !is_power_of_2(params->nr_entries) || params->nr_entries > DRV_RING_MAX_ENTRIES)
+    return -EINVAL;
+  if(!params->nr_buffers || params->nr_buffers > params->nr_entries || !params->buffer_size)
+    return -EINVAL;
+  /* Sizes close to 4G would wrap to 0 when rounded up to a page */
+  if(params->buffer_size > DRV_RING_MAX_BYTES)
+    return -EINVAL;
+  if((u64)PAGE_ALIGN(params->buffer_size) * params->nr_buffers > DRV_RING_MAX_BYTES)
+    return -EINVAL;
+
+  ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+  if(!ring)
+    return -ENOMEM;
+  ring->dev = dev;
+  ring->nr_entries = params->nr_entries;
+  ring->nr_buffers = params->nr_buffers;
+  ring->buffer_size = PAGE_ALIGN(params->buffer_size);
+  init_usb_anchor(&ring->anchor);
+  spin_lock_init(&ring->lock);
+  init_waitqueue_head(&ring->wait);
+
+  /* Queues region : header, submission entries, completion entries */
+  sq_off = L1_CACHE_ALIGN(sizeof(struct storage_ring_hdr));
+  cq_off = L1_CACHE_ALIGN(sq_off + ring->nr_entries * sizeof(struct storage_sqe));
+  ring->queues_bytes = PAGE_ALIGN(cq_off + ring->nr_entries * sizeof(struct storage_cqe));
+  ring->hdr = vmalloc_user(ring->queues_bytes);
+  if(!ring->hdr)
+    goto error;
+  ring->sqes = (void *)ring->hdr + sq_off;
+  ring->cqes = (void *)ring->hdr + cq_off;
+  ring->hdr->nr_entries = ring->nr_entries;
+
+  /* Buffers region : one DMA coherent block the device reads and writes in place */
+  ring->buffers_bytes = (size_t)ring->buffer_size * ring->nr_buffers;
+  ring->buffers = usb_alloc_coherent(dev->usb_dev, ring->buffers_bytes, GFP_KERNEL | __GFP_NOWARN, &ring->buffers_dma);
+  if(!ring->buffers)
+    goto error;
+
+  /* One URB per buffer, a buffer is never part of two transfers at once */
+  ring->reqs = kcalloc(ring->nr_buffers, sizeof(*ring->reqs), GFP_KERNEL);
+  if(!ring->reqs)
+    goto error;
+  for(ii = 0; ii < ring->nr_buffers; ii++)
+  {
+    ring->reqs[ii].ring = ring;
+    ring->reqs[ii].index = ii;
+    ring->reqs[ii].urb = usb_alloc_urb(0, GFP_KERNEL);
+    if(!ring->reqs[ii].urb)
+      goto error;
+  }
+
+  params->sq_off = sq_off;
+  params->cq_off = cq_off;
+  params->queues_size = ring->queues_bytes;
+  params->buffers_size = ring->buffers_bytes;
+  dev->ring = ring;
+  return 0;
+
+error:
+  dev_err(&dev->usb_intf->dev, "Could not allocate transfer ring\r\n");
+  drv_ring_free(dev, ring);
+  return -ENOMEM;
+}
+
+/* Post a completion entry, called with ring->lock held */
+static void drv_ring_complete(struct drv_ring *ring, __u64 user_data, int res, unsigned int index)
+{
+  struct storage_cqe *cqe;
+  u32 tail = ring->hdr->cq_tail;
+
+  cqe = &ring->cqes[tail & (ring->nr_entries - 1)];
+  cqe->user_data = user_data;
+  cqe->res = res;
+  cqe->buf_index = index;
+  /* Entry contents must be visible before the application sees the new tail */
+  smp_store_release(&ring->hdr->cq_tail, tail + 1);
+}
+
+/* Called when a ring transfer is completed */
+static void drv_ring_callback(struct urb *urb)
+{
+  struct drv_ring_req *req;
+  struct drv_ring *ring;
+  unsigned long flags;
+
+  /* Restore ring request from URB */
+  req = urb->context;
+  ring = req->ring;
+  drv_urb_complete(ring->dev, urb, &req->stamp);
+
+  if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+    dev_err(&ring->dev->usb_intf->dev,"%s - nonzero ring bulk status received: %d\n",__func__, urb->status);
+
+  spin_lock_irqsave(&ring->lock, flags);
+  drv_ring_complete(ring, req->user_data, urb->status ? urb->status : urb->actual_length, req->index);
+  req->busy = false;
+  ring->inflight--;
+  spin_unlock_irqrestore(&ring->lock, flags);
+
+  /* The waiters wake up once per batch, at the URB raising the interrupt
+     or at the unlink of drv_ring_enter() when that one failed */
+  if((urb->transfer_flags & URB_NO_INTERRUPT) && !urb->status &&
+     urb->actual_length == urb->transfer_buffer_length)
+    return;
+
+  /* Signal threads waiting for completions to wake up */
+  wake_up_interruptible(&ring->wait);
+}
+
+/* Turn one submission entry into a bulk URB, called with ring_mutex held.
+   Malformed entries complete at once and give NULL */
+static struct drv_ring_req *drv_ring_prepare(struct driver_private *dev, struct drv_ring *ring,
+                                             const struct storage_sqe *sqe)
+{
+  struct drv_ring_req *req;
+  unsigned int pipe;
+  int retval;
+
+  /* Reject malformed entries with an immediate completion */
+  if(sqe->buf_index >= ring->nr_buffers || !sqe->len || sqe->len > ring->buffer_size)
+  {
+    retval = -EINVAL;
+    goto complete;
+  }
+  if(sqe->opcode == STORAGE_OP_READ)
+    pipe = usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr);
+  else if(sqe->opcode == STORAGE_OP_WRITE)
+    pipe = usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr);
+  else
+  {
+    retval = -EINVAL;
+    goto complete;
+  }
+
+  req = &ring->reqs[sqe->buf_index];
+  spin_lock_irq(&ring->lock);
+  if(req->busy)
+  {
+    spin_unlock_irq(&ring->lock);
+    retval = -EBUSY;
+    goto complete;
+  }
+  req->busy = true;
+  req->user_data = sqe->user_data;
+  ring->inflight++;
+  spin_unlock_irq(&ring->lock);
+
+  /* The URB points straight into the buffer the application filled */
+  usb_fill_bulk_urb(req->urb, dev->usb_dev, pipe,
+                    ring->buffers + (size_t)req->index * ring->buffer_size, sqe->len,
+                    drv_ring_callback, req);
+  req->urb->transfer_dma = ring->buffers_dma + (size_t)req->index * ring->buffer_size;
+  req->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+  return req;
+
+complete:
+  spin_lock_irq(&ring->lock);
+  drv_ring_complete(ring, sqe->user_data, retval, sqe->buf_index);
+  spin_unlock_irq(&ring->lock);
+  wake_up_interruptible(&ring->wait);
+  return NULL;
+}
+
+/* Submit a prepared ring URB, irq is false for all but the last of a batch
+   on its endpoint. Called with ring_mutex held, a failure completes it at once */
+static int drv_ring_submit_one(struct driver_private *dev, struct drv_ring *ring,
+                               struct drv_ring_req *req, bool irq)
+{
+  int retval;
+
+  if(irq)
+    req->urb->transfer_flags &= ~URB_NO_INTERRUPT;
+  else
+    req->urb->transfer_flags |= URB_NO_INTERRUPT;
+  usb_anchor_urb(req->urb, &ring->anchor);
+
+  drv_urb_submit(dev, req->urb, &req->stamp);
+  retval = usb_submit_urb(req->urb, GFP_KERNEL);
+  if(!retval)
+    return 0;
+
+  dev_err(&dev->usb_intf->dev,"%s - Failed submitting ring urb, error %d\n",__func__, retval);
+  drv_urb_submit_failed(dev, req->urb, &req->stamp, retval);
+  usb_unanchor_urb(req->urb);
+  spin_lock_irq(&ring->lock);
+  req->busy = false;
+  ring->inflight--;
+  drv_ring_complete(ring, req->user_data, retval, req->index);
+  spin_unlock_irq(&ring->lock);
+  wake_up_interruptible(&ring->wait);
+  return retval;
+}
+
+/* No of completion entries not reaped by the application yet */
+static u32 drv_ring_pending(struct drv_ring *ring)
+{
+  return smp_load_acquire(&ring->hdr->cq_tail) - READ_ONCE(ring->hdr->cq_head);
+}
+
+/* Consume submission entries and wait for completions */
+static int drv_ring_enter(struct driver_private *dev, struct storage_ring_enter *enter)
+{
+  struct drv_ring *ring;
+  struct storage_sqe sqe;
+  struct drv_ring_req *req;
+  /* Per direction, the URB held back until it is known whether another
+     one follows it on the same endpoint, and the URBs since the last interrupt */
+  struct drv_ring_req *held[DRV_STAT_NR_DIRS] = {};
+  unsigned int batched[DRV_STAT_NR_DIRS] = {};
+  unsigned int batch;
+  bool stranded = false;
+  bool irq;
+  u32 head, tail;
+  unsigned int submitted = 0;
+  int dir;
+  int retval;
+
+  retval = mutex_lock_interruptible(&dev->ring_mutex);
+  if(retval < 0)
+    return retval;
+
+  ring = dev->ring;
+  if(!ring || dev->disconnected)
+  {
+    mutex_unlock(&dev->ring_mutex);
+    return ring ? -ENODEV : -ENXIO;
+  }
+
+  head = ring->hdr->sq_head;
+  /* Entries must be read only after the application published the tail */
+  tail = smp_load_acquire(&ring->hdr->sq_tail);
+
+  batch = drv_irq_batch(ring->nr_buffers);
+  while(submitted < enter->to_submit && head != tail)
+  {
+    /* Keep room in the completion queue for every transfer in flight,
+       the held URBs included */
+    if(drv_ring_pending(ring) + ring->inflight >= ring->nr_entries)
+      break;
+
+    /* Work on a private copy, the application may scribble over the entry */
+    memcpy(&sqe, &ring->sqes[head & (ring->nr_entries - 1)], sizeof(sqe));
+    head++;
+    submitted++;
+    req = drv_ring_prepare(dev, ring, &sqe);
+    if(!req)
+      continue;
+
+    /* Another URB follows the held one, which interrupts only if it ends a batch */
+    dir = usb_pipein(req->urb->pipe) ? DRV_STAT_READ : DRV_STAT_WRITE;
+    if(held[dir])
+    {
+      irq = !(++batched[dir] % batch);
+      if(drv_ring_submit_one(dev, ring, held[dir], irq) && irq && batch > 1)
+        stranded = true;
+    }
+    held[dir] = req;
+  }
+
+  /* The last URB of each direction always interrupts */
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+  {
+    if(held[dir] && drv_ring_submit_one(dev, ring, held[dir], true) && batched[dir] % batch)
+      stranded = true;
+  }
+  /* The URBs posted ahead of a failed interrupting one wait for an interrupt
+     that never comes, unlinking them makes the host controller give them back */
+  if(stranded)
+  {
+    usb_unlink_anchored_urbs(&ring->anchor);
+    wake_up_interruptible(&ring->wait);
+  }
+  smp_store_release(&ring->hdr->sq_head, head);
+
+  if(!enter->min_complete)
+  {
+    mutex_unlock(&dev->ring_mutex);
+    return submitted;
+  }
+
+  /* Sleep without ring_mutex, a waiter keeps the ring from being torn down */
+  ring->waiters++;
+  mutex_unlock(&dev->ring_mutex);
+
+  retval = wait_event_interruptible(ring->wait,
+                                    drv_ring_pending(ring) >= min(enter->min_complete, ring->nr_entries) ||
+                                    dev->disconnected);
+
+  mutex_lock(&dev->ring_mutex);
+  ring->waiters--;
+  mutex_unlock(&dev->ring_mutex);
+
+  if(retval < 0 && !submitted)
+    return retval;
+  return submitted;
+}
+
+/* Bulk-Only Mass Storage Reset followed by clearing both halts, BOT 5.3.4 */
+static int drv_bot_reset_recovery(struct driver_private *dev)
+{
+  int retval;
+
+  retval = usb_control_msg(dev->usb_dev, usb_sndctrlpipe(dev->usb_dev, 0),
+                           US_BULK_RESET_REQUEST, USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+                           0, dev->usb_intf->cur_altsetting->desc.bInterfaceNumber,
+                           NULL, 0, USB_CTRL_SET_TIMEOUT);
+  if(retval < 0)
+    dev_err(&dev->usb_intf->dev,"%s - Bulk-Only reset failed, error %d\n",__func__, retval);
+
+  usb_clear_halt(dev->usb_dev, usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr));
+  usb_clear_halt(dev->usb_dev, usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr));
+  return retval;
+}
+
+/* Run one command through the CBW, data and CSW phases, called with cmd_mutex held */
+static int drv_bot_transport(struct driver_private *dev, struct drv_scsi_cmd *cmd)
+{
+  struct bulk_cb_wrap *cbw = dev->bot_cbw;
+  struct bulk_cs_wrap *csw = dev->bot_csw;
+  struct usb_sg_request io;
+  unsigned int rcvpipe = usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr);
+  unsigned int sndpipe = usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr);
+  unsigned int pipe;
+  unsigned int transferred = 0;
+  unsigned int residue;
+  int actual;
+  int retval;
+
+  cmd->status = US_BULK_STAT_PHASE;
+  cmd->residue = cmd->len;
+  cmd->sense_written = 0;
+
+  /* Command Block Wrapper, every command gets a fresh tag */
+  memset(cbw, 0, sizeof(*cbw));
+  cbw->Signature = cpu_to_le32(US_BULK_CB_SIGN);
+  cbw->Tag = ++dev->bot_tag;
+  cbw->DataTransferLength = cpu_to_le32(cmd->len);
+  cbw->Flags = (cmd->dir == STORAGE_DIR_IN) ? US_BULK_FLAG_IN : 0;
+  cbw->Lun = cmd->lun;
+  cbw->Length = cmd->cdb_len;
+  memcpy(cbw->CDB, cmd->cdb, cmd->cdb_len);
+
+  retval = usb_bulk_msg(dev->usb_dev, sndpipe, cbw, US_BULK_CB_WRAP_LEN, &actual, cmd->timeout);
+  if(retval < 0)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - CBW failed, error %d\n",__func__, retval);
+    drv_bot_reset_recovery(dev);
+    return retval;
+  }
+
+  /* Data phase, the whole scatterlist goes out as one request */
+  if(cmd->len)
+  {
+    pipe = (cmd->dir == STORAGE_DIR_IN) ? rcvpipe : sndpipe;
+    retval = usb_sg_init(&io, dev->usb_dev, pipe, 0, cmd->sg, cmd->nents, cmd->len, GFP_NOIO);
+    if(retval < 0)
+    {
+      drv_bot_reset_recovery(dev);
+      return retval;
+    }
+    usb_sg_wait(&io);
+    transferred = io.bytes;
+
+    /* A stalled data pipe is cleared and the CSW still follows, BOT 6.7.2/6.7.3 */
+    if(io.status == -EPIPE)
+      usb_clear_halt(dev->usb_dev, pipe);
+    else if(io.status && io.status != -EREMOTEIO)
+    {
+      dev_err(&dev->usb_intf->dev,"%s - Data phase failed, error %d\n",__func__, io.status);
+      drv_bot_reset_recovery(dev);
+      return io.status;
+    }
+  }
+
+  /* Command Status Wrapper, retried once after a stall, BOT 6.7.2 */
+  retval = usb_bulk_msg(dev->usb_dev, rcvpipe, csw, US_BULK_CS_WRAP_LEN, &actual, cmd->timeout);
+  if(retval == -EPIPE)
+  {
+    usb_clear_halt(dev->usb_dev, rcvpipe);
+    retval = usb_bulk_msg(dev->usb_dev, rcvpipe, csw, US_BULK_CS_WRAP_LEN, &actual, cmd->timeout);
+  }
+  if(retval < 0)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - CSW failed, error %d\n",__func__, retval);
+    drv_bot_reset_recovery(dev);
+    return retval;
+  }
+
+  /* A CSW that is not meaningful calls for a reset recovery, BOT 6.3 */
+  if(actual != US_BULK_CS_WRAP_LEN || csw->Signature != cpu_to_le32(US_BULK_CS_SIGN) ||
+     csw->Tag != cbw->Tag || csw->Status > US_BULK_STAT_PHASE)
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Invalid CSW for tag %u\n",__func__, cbw->Tag);
+    drv_bot_reset_recovery(dev);
+    return -EIO;
+  }
+
+  /* Trust the larger of the reported residue and what really did not move */
+  residue = min(le32_to_cpu(csw->Residue), cmd->len);
+  cmd->residue = max(residue, cmd->len - transferred);
+  cmd->status = csw->Status;
+
+  if(cmd->status == US_BULK_STAT_PHASE)
+  {
+    drv_bot_reset_recovery(dev);
+    return -EIO;
+  }
+  return 0;
+}
+
+/* Record the first error of a UAS command and cancel its other URBs */
+static void drv_uas_abort(struct drv_uas_cmd *uas, int error)
+{
+  if(cmpxchg(&uas->result, 0, error))
+    return;
+  usb_unlink_urb(uas->status_urb);
+  usb_unlink_urb(uas->data_urb);
+  usb_unlink_urb(uas->cmd_urb);
+}
+
+/* Status pipe completion, a Sense IU carries the SCSI status and sense data */
+static void drv_uas_status(struct drv_uas_cmd *uas, struct urb *urb)
+{
+  struct drv_scsi_cmd *cmd = uas->scsi;
+  struct sense_iu *iu = uas->sense_iu;
+  unsigned int len;
+
+  if(urb->actual_length < 4 || be16_to_cpu(iu->tag) != uas->tag)
+  {
+    drv_uas_abort(uas, -EIO);
+    return;
+  }
+
+  switch(iu->iu_id)
+  {
+  case IU_ID_STATUS:
+    cmd->status = (iu->status == SAM_STAT_GOOD) ? US_BULK_STAT_OK : US_BULK_STAT_FAIL;
+    if(cmd->status != US_BULK_STAT_OK && cmd->sense && urb->actual_length > 16)
+    {
+      len = min3((unsigned int)be16_to_cpu(iu->len), urb->actual_length - 16, cmd->sense_len);
+      memcpy(cmd->sense, iu->sense, len);
+      cmd->sense_written = len;
+    }
+    break;
+  default:
+    /* A Response IU means the device rejected the command itself, READ READY
+       and WRITE READY never show up since every command has a stream */
+    drv_uas_abort(uas, -EIO);
+    break;
+  }
+}
+
+/* Completion of any of the three URBs, the last one finishes the command */
+static void drv_uas_callback(struct urb *urb)
+{
+  struct drv_uas_cmd *uas = urb->context;
+  struct drv_scsi_cmd *cmd = uas->scsi;
+
+  /* UAS URBs are traced with their tag as req_id */
+  drv_urb_trace_done(uas->dev, urb, uas->tag);
+
+  if(urb->status)
+  {
+    if(!(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+      dev_err_ratelimited(&uas->dev->usb_intf->dev,"%s - Tag %u URB failed, status %d\n",__func__,
+                          uas->tag, urb->status);
+    drv_uas_abort(uas, urb->status);
+  }
+  else if(urb == uas->status_urb)
+  {
+    drv_uas_status(uas, urb);
+  }
+  else if(urb == uas->data_urb)
+  {
+    cmd->residue = cmd->len - urb->actual_length;
+  }
+
+  if(atomic_dec_and_test(&uas->pending))
+    uas->done(uas);
+}
+
+/* Submit the status, data and command URBs of one command on its stream,
+   the outcome is always reported through uas->done() */
+static void drv_uas_submit(struct drv_uas_cmd *uas, gfp_t gfp)
+{
+  struct driver_private *dev = uas->dev;
+  struct drv_scsi_cmd *cmd = uas->scsi;
+  struct command_iu *iu = uas->cmd_iu;
+  struct urb *urbs[3];
+  unsigned int nr_urbs = 0;
+  unsigned int ii;
+  int retval = 0;
+
+  cmd->status = US_BULK_STAT_PHASE;
+  cmd->residue = cmd->len;
+  cmd->sense_written = 0;
+  uas->result = 0;
+
+  memset(iu, 0, sizeof(*iu));
+  iu->iu_id = IU_ID_COMMAND;
+  iu->tag = cpu_to_be16(uas->tag);
+  iu->prio_attr = UAS_SIMPLE_TAG;
+  /* Single level LUN addressing */
+  iu->lun.scsi_lun[0] = (cmd->lun >> 8) & 0x3f;
+  iu->lun.scsi_lun[1] = cmd->lun & 0xff;
+  memcpy(iu->cdb, cmd->cdb, cmd->cdb_len);
+
+  usb_fill_bulk_urb(uas->status_urb, dev->usb_dev, dev->uas_status_pipe, uas->sense_iu,
+                    sizeof(*uas->sense_iu), drv_uas_callback, uas);
+  uas->status_urb->stream_id = uas->tag;
+  urbs[nr_urbs++] = uas->status_urb;
+
+  if(cmd->len)
+  {
+    usb_fill_bulk_urb(uas->data_urb, dev->usb_dev,
+                      (cmd->dir == STORAGE_DIR_IN) ? dev->uas_data_in_pipe : dev->uas_data_out_pipe,
+                      NULL, cmd->len, drv_uas_callback, uas);
+    uas->data_urb->sg = cmd->sg;
+    uas->data_urb->num_sgs = cmd->nents;
+    uas->data_urb->stream_id = uas->tag;
+    urbs[nr_urbs++] = uas->data_urb;
+  }
+
+  /* The command goes last so that the device finds its stream already posted */
+  usb_fill_bulk_urb(uas->cmd_urb, dev->usb_dev, dev->uas_cmd_pipe, iu, sizeof(*iu),
+                    drv_uas_callback, uas);
+  urbs[nr_urbs++] = uas->cmd_urb;
+
+  /* One extra count keeps the command alive until the loop is done */
+  atomic_set(&uas->pending, 1);
+  for(ii = 0; ii < nr_urbs; ii++)
+  {
+    atomic_inc(&uas->pending);
+    usb_anchor_urb(urbs[ii], &dev->uas_anchor);
+    trace_usbflash_urb_submit(dev->usb_intf->minor, urbs[ii], 0, uas->tag);
+    retval = usb_submit_urb(urbs[ii], gfp);
+    if(retval)
+    {
+      trace_usbflash_urb_error(dev->usb_intf->minor, urbs[ii], retval, uas->tag);
+      usb_unanchor_urb(urbs[ii]);
+      atomic_dec(&uas->pending);
+      drv_uas_abort(uas, retval);
+      break;
+    }
+  }
+
+  if(atomic_dec_and_test(&uas->pending))
+    uas->done(uas);
+}
+
+/* Allocate the URBs and information unit buffers of one command slot */
+static int drv_uas_cmd_init(struct driver_private *dev, struct drv_uas_cmd *uas, gfp_t gfp)
+{
+  uas->dev = dev;
+  uas->cmd_urb = usb_alloc_urb(0, gfp);
+  uas->status_urb = usb_alloc_urb(0, gfp);
+  uas->data_urb = usb_alloc_urb(0, gfp);
+  uas->cmd_iu = kmalloc(sizeof(*uas->cmd_iu), gfp);
+  uas->sense_iu = kmalloc(sizeof(*uas->sense_iu), gfp);
+  if(!uas->cmd_urb || !uas->status_urb || !uas->data_urb || !uas->cmd_iu || !uas->sense_iu)
+    return -ENOMEM;
+  return 0;
+}
+
+static void drv_uas_cmd_free(struct drv_uas_cmd *uas)
+{
+  usb_free_urb(uas->cmd_urb);
+  usb_free_urb(uas->status_urb);
+  usb_free_urb(uas->data_urb);
+  kfree(uas->cmd_iu);
+  kfree(uas->sense_iu);
+}
+
+static void drv_uas_exec_done(struct drv_uas_cmd *uas)
+{
+  complete(&uas->dev->uas_exec_done);
+}
+
+/* Run one command on the tag reserved for synchronous commands, called with cmd_mutex held */
+static int drv_uas_exec(struct driver_private *dev, struct drv_scsi_cmd *cmd)
+{
+  struct drv_uas_cmd *uas = &dev->uas_exec;
+
+  uas->scsi = cmd;
+  reinit_completion(&dev->uas_exec_done);
+  drv_uas_submit(uas, GFP_NOIO);
+
+  if(!wait_for_completion_timeout(&dev->uas_exec_done, cmd->timeout))
+  {
+    drv_uas_abort(uas, -ETIMEDOUT);
+    wait_for_completion(&dev->uas_exec_done);
+  }
+  return uas->result;
+}
+
+/* Run one command on whichever transport the interface uses, called with cmd_mutex held */
+static int drv_scsi_transport(struct driver_private *dev, struct drv_scsi_cmd *cmd)
+{
+  if(dev->uas)
+    return drv_uas_exec(dev, cmd);
+  return drv_bot_transport(dev, cmd);
+}
+
+/* Find an alternate setting speaking UAS, its pipes are told apart by the
+   Pipe Usage descriptors following each endpoint */
+static struct usb_host_interface *drv_uas_find_altsetting(struct usb_interface *intf,
+                                                          struct usb_host_endpoint *eps[4])
+{
+  struct usb_host_interface *alt;
+  struct usb_host_endpoint *ep;
+  unsigned char *extra;
+  int len;
+  unsigned int ii, jj;
+  u8 pipe_id;
+
+  for(ii = 0; ii < intf->num_altsetting; ii++)
+  {
+    alt = &intf->altsetting[ii];
+    if(alt->desc.bInterfaceClass != USB_CLASS_MASS_STORAGE ||
+       alt->desc.bInterfaceSubClass != USB_SC_SCSI ||
+       alt->desc.bInterfaceProtocol != USB_PR_UAS)
+      continue;
+
+    memset(eps, 0, 4 * sizeof(eps[0]));
+    for(jj = 0; jj < alt->desc.bNumEndpoints; jj++)
+    {
+      ep = &alt->endpoint[jj];
+      extra = ep->extra;
+      len = ep->extralen;
+      while(len >= 2 && extra[0] >= 2 && extra[0] <= len)
+      {
+        if(extra[1] == USB_DT_PIPE_USAGE && extra[0] >= sizeof(struct usb_pipe_usage_descriptor))
+        {
+          pipe_id = ((struct usb_pipe_usage_descriptor *)extra)->bPipeID;
+          if(pipe_id >= CMD_PIPE_ID && pipe_id <= DATA_OUT_PIPE_ID)
+            eps[pipe_id - 1] = ep;
+        }
+        len -= extra[0];
+        extra += extra[0];
+      }
+    }
+
+    if(eps[0] && usb_endpoint_is_bulk_out(&eps[0]->desc) &&
+       eps[1] && usb_endpoint_is_bulk_in(&eps[1]->desc) &&
+       eps[2] && usb_endpoint_is_bulk_in(&eps[2]->desc) &&
+       eps[3] && usb_endpoint_is_bulk_out(&eps[3]->desc))
+      return alt;
+  }
+  return NULL;
+}
+
+/* Switch to the UAS alternate setting when the device has one and the host
+   can give its status and data pipes streams, BOT stays in use otherwise */
+static int drv_uas_setup(struct driver_private *dev)
+{
+  struct usb_interface *intf = dev->usb_intf;
+  struct usb_host_interface *alt;
+  struct usb_host_endpoint *eps[4];
+  unsigned int max_streams = DRV_UAS_MAX_STREAMS;
+  unsigned int ii;
+  int retval;
+
+  alt = drv_uas_find_altsetting(intf, eps);
+  if(!alt)
+    return -ENODEV;
+
+  /* Tags only run concurrently with streams, and the data URBs are scatter-gather */
+  if(dev->usb_dev->speed < USB_SPEED_SUPER || !dev->usb_dev->bus->sg_tablesize)
+    return -EOPNOTSUPP;
+  for(ii = 1; ii < 4; ii++)
+    max_streams = min_t(unsigned int, max_streams, usb_ss_max_streams(&eps[ii]->ss_ep_comp));
+  if(max_streams < 2)
+    return -EOPNOTSUPP;
+
+  retval = usb_set_interface(dev->usb_dev, alt->desc.bInterfaceNumber, alt->desc.bAlternateSetting);
+  if(retval < 0)
+    return retval;
+
+  retval = usb_alloc_streams(intf, &eps[1], 3, max_streams, GFP_KERNEL);
+  if(retval < 2)
+  {
+    if(retval > 0)
+      usb_free_streams(intf, &eps[1], 3, GFP_KERNEL);
+    retval = (retval < 0) ? retval : -ENOSPC;
+    goto exit;
+  }
+  dev->uas_streams = retval;
+
+  dev->uas_cmd_pipe = usb_sndbulkpipe(dev->usb_dev, usb_endpoint_num(&eps[0]->desc));
+  dev->uas_status_pipe = usb_rcvbulkpipe(dev->usb_dev, usb_endpoint_num(&eps[1]->desc));
+  dev->uas_data_in_pipe = usb_rcvbulkpipe(dev->usb_dev, usb_endpoint_num(&eps[2]->desc));
+  dev->uas_data_out_pipe = usb_sndbulkpipe(dev->usb_dev, usb_endpoint_num(&eps[3]->desc));
+  for(ii = 0; ii < 3; ii++)
+    dev->uas_stream_eps[ii] = eps[ii + 1];
+
+  /* Stream 1 belongs to synchronous commands, the block layer's tags follow */
+  retval = drv_uas_cmd_init(dev, &dev->uas_exec, GFP_KERNEL);
+  if(retval < 0)
+  {
+    drv_uas_cmd_free(&dev->uas_exec);
+    memset(&dev->uas_exec, 0, sizeof(dev->uas_exec));
+    usb_free_streams(intf, dev->uas_stream_eps, 3, GFP_KERNEL);
+    goto exit;
+  }
+  dev->uas_exec.tag = 1;
+  dev->uas_exec.done = drv_uas_exec_done;
+
+  dev->uas = true;
+  dev_info(&intf->dev, "UAS with %u streams\r\n", dev->uas_streams);
+  return 0;
+
+exit:
+  usb_set_interface(dev->usb_dev, alt->desc.bInterfaceNumber, 0);
+  return retval;
+}
+
+/* Host side endpoints of the striped pairs, returns their number */
+static unsigned int drv_bulk_stream_eps(struct driver_private *dev, struct usb_host_endpoint **eps)
+{
+  unsigned int nr = 0;
+  unsigned int ii;
+  int dir;
+
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+    for(ii = 0; ii < dev->nr_stripes; ii++)
+      eps[nr++] = dev->bulk_eps[dir][ii].hep;
+  return nr;
+}
+
+/* Give the striped bulk endpoints streams when the device and the host
+   controller support them, raw transfers run without streams otherwise */
+static void drv_bulk_streams_setup(struct driver_private *dev)
+{
+  struct usb_host_endpoint *eps[DRV_STAT_NR_DIRS * DRV_MAX_BULK_EPS];
+  unsigned int max_streams = bulk_streams;
+  unsigned int nr_eps;
+  unsigned int ii;
+  int retval;
+
+  /* Bulk-Only commands and UAS have no use for streams on these endpoints */
+  if(!max_streams || dev->bot_capable || dev->usb_dev->speed < USB_SPEED_SUPER)
+    return;
+  nr_eps = drv_bulk_stream_eps(dev, eps);
+  for(ii = 0; ii < nr_eps; ii++)
+    max_streams = min_t(unsigned int, max_streams, usb_ss_max_streams(&eps[ii]->ss_ep_comp));
+  if(max_streams < 2)
+    return;
+
+  /* Every endpoint gets the same number of streams, or none at all */
+  retval = usb_alloc_streams(dev->usb_intf, eps, nr_eps, max_streams, GFP_KERNEL);
+  if(retval < 2)
+  {
+    if(retval > 0)
+      usb_free_streams(dev->usb_intf, eps, nr_eps, GFP_KERNEL);
+    dev_info(&dev->usb_intf->dev, "No bulk streams, error %d\r\n", retval);
+    return;
+  }
+  dev->bulk_streams = retval;
+  dev_info(&dev->usb_intf->dev, "Bulk streams : %u per endpoint\r\n", dev->bulk_streams);
+}
+
+/* Release the streams of the striped bulk endpoints, none of their URBs may be in flight */
+static void drv_bulk_streams_free(struct driver_private *dev)
+{
+  struct usb_host_endpoint *eps[DRV_STAT_NR_DIRS * DRV_MAX_BULK_EPS];
+
+  if(!dev->bulk_streams)
+    return;
+  usb_free_streams(dev->usb_intf, eps, drv_bulk_stream_eps(dev, eps), GFP_KERNEL);
+  dev->bulk_streams = 0;
+}
+
+/* Take the bulk endpoints away from raw I/O for a SCSI batch or a self-test.
+   Readers, writers and URB submissions wait until drv_raw_resume() */
+static int drv_raw_quiesce(struct driver_private *dev)
+{
+  int retval;
+
+  /* Staged writes go out first, they are drained below */
+  retval = drv_write_unstage(dev, false);
+  if(retval < 0)
+    return retval;
+
+  retval = mutex_lock_interruptible(&dev->read_mutex);
+  if(retval < 0)
+    return retval;
+  retval = mutex_lock_interruptible(&dev->write_mutex);
+  if(retval < 0)
+    goto unlock_read;
+  retval = mutex_lock_interruptible(&dev->io_mutex);
+  if(retval < 0)
+    goto unlock_write;
+  if(dev->disconnected)
+  {
+    retval = -ENODEV;
+    goto unlock_io;
+  }
+
+  /* Raw traffic would swallow a CSW or land in the middle of a run */
+  drv_read_stop(dev);
+  if(!usb_wait_anchor_empty_timeout(&dev->aio_in_anchor, DRV_WRITE_DRAIN_TIMEOUT_MS))
+    usb_kill_anchored_urbs(&dev->aio_in_anchor);
+  retval = drv_write_drain(dev);
+  if(retval < 0)
+    goto unlock_io;
+  return 0;
+
+unlock_io:
+  mutex_unlock(&dev->io_mutex);
+unlock_write:
+  mutex_unlock(&dev->write_mutex);
+unlock_read:
+  mutex_unlock(&dev->read_mutex);
+  return retval;
+}
+
+/* Give the bulk endpoints back to raw I/O */
+static void drv_raw_resume(struct driver_private *dev)
+{
+  mutex_unlock(&dev->io_mutex);
+  mutex_unlock(&dev->write_mutex);
+  mutex_unlock(&dev->read_mutex);
+}
+
+/* Run one command of a batch from user memory, called with the endpoints
+   quiesced and the read bounce list locked */
+static void drv_scsi_batch_one(struct driver_private *dev, struct storage_scsi_cmd *ucmd)
+{
+  struct drv_sg_bounce *bounce = &dev->sg_bounce[DRV_STAT_READ];
+  struct drv_scsi_cmd cmd;
+  struct scatterlist sense_sg;
+  struct iov_iter iter;
+  u8 sense_cdb[6];
+  unsigned int sense_len;
+  int retval;
+
+  ucmd->status = STORAGE_STATUS_PHASE;
+  ucmd->residue = ucmd->data_len;
+  ucmd->sense_written = 0;
+
+  if(!ucmd->cdb_len || ucmd->cdb_len > sizeof(ucmd->cdb) || ucmd->dir > STORAGE_DIR_OUT ||
+     (ucmd->dir == STORAGE_DIR_NONE) != !ucmd->data_len || ucmd->data_len > bounce->size)
+  {
+    ucmd->result = -EINVAL;
+    return;
+  }
+
+  cmd.cdb = ucmd->cdb;
+  cmd.cdb_len = ucmd->cdb_len;
+  cmd.lun = ucmd->lun;
+  cmd.dir = ucmd->dir;
+  cmd.sg = bounce->sgl;
+  cmd.nents = DIV_ROUND_UP(ucmd->data_len, PAGE_SIZE);
+  cmd.len = ucmd->data_len;
+  cmd.timeout = msecs_to_jiffies(ucmd->timeout_ms ? ucmd->timeout_ms : DRV_BOT_TIMEOUT_MS);
+  cmd.sense = dev->bot_sense;
+  cmd.sense_len = min_t(unsigned int, ucmd->sense_len, DRV_SENSE_SIZE);
+
+  if(cmd.len)
+  {
+    retval = import_ubuf((cmd.dir == STORAGE_DIR_OUT) ? ITER_SOURCE : ITER_DEST,
+                         u64_to_user_ptr(ucmd->data), cmd.len, &iter);
+    if(!retval && cmd.dir == STORAGE_DIR_OUT)
+      retval = drv_sg_fill(bounce, &iter, cmd.len);
+    if(retval < 0)
+    {
+      ucmd->result = retval;
+      return;
+    }
+  }
+
+  mutex_lock(&dev->cmd_mutex);
+  retval = drv_scsi_transport(dev, &cmd);
+  ucmd->result = retval;
+  ucmd->status = cmd.status;
+  ucmd->residue = cmd.residue;
+
+  /* UAS hands the sense data over with the status */
+  if(cmd.sense_written && !copy_to_user(u64_to_user_ptr(ucmd->sense), dev->bot_sense, cmd.sense_written))
+    ucmd->sense_written = cmd.sense_written;
+
+  /* Bulk-Only needs a REQUEST SENSE before anything else runs */
+  else if(!retval && !dev->uas && cmd.status == US_BULK_STAT_FAIL && ucmd->sense_len)
+  {
+    sense_len = min_t(unsigned int, ucmd->sense_len, DRV_SENSE_SIZE);
+    memset(sense_cdb, 0, sizeof(sense_cdb));
+    sense_cdb[0] = REQUEST_SENSE;
+    sense_cdb[4] = sense_len;
+    sg_init_one(&sense_sg, dev->bot_sense, sense_len);
+
+    cmd.cdb = sense_cdb;
+    cmd.cdb_len = sizeof(sense_cdb);
+    cmd.dir = STORAGE_DIR_IN;
+    cmd.sg = &sense_sg;
+    cmd.nents = 1;
+    cmd.len = sense_len;
+    cmd.sense = NULL;
+    if(!drv_bot_transport(dev, &cmd) && cmd.status == US_BULK_STAT_OK &&
+       !copy_to_user(u64_to_user_ptr(ucmd->sense), dev->bot_sense, sense_len - cmd.residue))
+      ucmd->sense_written = sense_len - cmd.residue;
+  }
+  mutex_unlock(&dev->cmd_mutex);
+
+  /* Hand the received part of the data phase back */
+  if(!retval && ucmd->dir == STORAGE_DIR_IN && ucmd->data_len - ucmd->residue)
+  {
+    if(drv_sg_drain(bounce, &iter, ucmd->data_len - ucmd->residue) != (ssize_t)(ucmd->data_len - ucmd->residue))
+      ucmd->result = -EFAULT;
+  }
+}
+
+/* STORAGE_IOC_SCSI_BATCH, the per-command setup is paid once per batch */
+static int drv_scsi_batch(struct driver_private *dev, struct storage_scsi_batch __user *ubatch)
+{
+  struct storage_scsi_batch batch;
+  struct storage_scsi_cmd __user *ucmds;
+  struct storage_scsi_cmd ucmd;
+  int retval;
+
+  if(!dev->bot_capable && !dev->uas)
+    return -EOPNOTSUPP;
+  if(copy_from_user(&batch, ubatch, sizeof(batch)))
+    return -EFAULT;
+  if(!batch.nr_cmds || batch.nr_cmds > DRV_SCSI_MAX_BATCH)
+    return -EINVAL;
+  ucmds = u64_to_user_ptr(batch.cmds);
+  batch.nr_done = 0;
+
+  /* Raw traffic would swallow a CSW or wedge itself between the phases */
+  retval = drv_raw_quiesce(dev);
+  if(retval < 0)
+    return retval;
+
+  mutex_lock(&dev->sg_bounce[DRV_STAT_READ].lock);
+  retval = drv_sg_bounce_get(&dev->sg_bounce[DRV_STAT_READ]);
+  if(retval < 0)
+    goto exit_sg;
+
+  for(; batch.nr_done < batch.nr_cmds; batch.nr_done++)
+  {
+    if(copy_from_user(&ucmd, &ucmds[batch.nr_done], sizeof(ucmd)))
+    {
+      retval = -EFAULT;
+      break;
+    }
+
+    drv_scsi_batch_one(dev, &ucmd);
+
+    if(copy_to_user(&ucmds[batch.nr_done], &ucmd, sizeof(ucmd)))
+    {
+      retval = -EFAULT;
+      break;
+    }
+    if((batch.flags & STORAGE_BATCH_STOP_ON_ERROR) && (ucmd.result || ucmd.status != STORAGE_STATUS_GOOD))
+    {
+      batch.nr_done++;
+      break;
+    }
+  }
+
+exit_sg:
+  mutex_unlock(&dev->sg_bounce[DRV_STAT_READ].lock);
+  if(put_user(batch.nr_done, &ubatch->nr_done))
+    retval = -EFAULT;
+  drv_raw_resume(dev);
+  return retval;
+}
+
+static long drv_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct driver_private *dev;
+  struct drv_file *ctx = file->private_data;
+  struct storage_ring_params params;
+  struct storage_ring_enter enter;
+  struct storage_qos qos;
+  void __user *argp = (void __user *)arg;
+  long retval;
+
+  /* Restore driver private structure from the file handle */
+  dev = ctx->dev;
+
+  switch(cmd)
+  {
+  case STORAGE_IOC_RING_SETUP:
+    if(copy_from_user(&params, argp, sizeof(params)))
+      return -EFAULT;
+
+    mutex_lock(&dev->ring_mutex);
+    if(dev->disconnected)
+      retval = -ENODEV;
+    else if(dev->ring)
+      retval = -EBUSY;
+    else
+      retval = drv_ring_setup(dev, &params);
+    if(!retval && copy_to_user(argp, &params, sizeof(params)))
+    {
+      drv_ring_destroy(dev);
+      retval = -EFAULT;
+    }
+    mutex_unlock(&dev->ring_mutex);
+    return retval;
+
+  case STORAGE_IOC_RING_ENTER:
+    if(copy_from_user(&enter, argp, sizeof(enter)))
+      return -EFAULT;
+    return drv_ring_enter(dev, &enter);
+
+  case STORAGE_IOC_SCSI_BATCH:
+    return drv_scsi_batch(dev, argp);
+
+  case STORAGE_IOC_SET_QOS:
+    if(copy_from_user(&qos, argp, sizeof(qos)))
+      return -EFAULT;
+    return drv_sched_set_qos(dev, ctx, &qos);
+
+  case STORAGE_IOC_GET_QOS:
+    spin_lock(&dev->sched_lock);
+    qos = ctx->qos;
+    spin_unlock(&dev->sched_lock);
+    if(copy_to_user(argp, &qos, sizeof(qos)))
+      return -EFAULT;
+    return 0;
+
+  case STORAGE_IOC_RING_TEARDOWN:
+    /* The regions must not vanish under a live mapping or a waiter */
+    mutex_lock(&dev->ring_mutex);
+    if(dev->ring && (atomic_read(&dev->ring->mapped) || dev->ring->waiters))
+      retval = -EBUSY;
+    else
+    {
+      drv_ring_destroy(dev);
+      retval = 0;
+    }
+    mutex_unlock(&dev->ring_mutex);
+    return retval;
+
+  default:
+    return -ENOTTY;
+  }
+}
+
+/* Keep track of the mappings so that the ring is not torn down under them */
+static void drv_ring_vm_open(struct vm_area_struct *vma)
+{
+  struct drv_ring *ring = vma->vm_private_data;
+
+  atomic_inc(&ring->mapped);
+}
+
+static void drv_ring_vm_close(struct vm_area_struct *vma)
+{
+  struct drv_ring *ring = vma->vm_private_data;
+
+  atomic_dec(&ring->mapped);
+}
+
+static const struct vm_operations_struct drv_ring_vm_ops =
+{
+  .open  = drv_ring_vm_open,
+  .close = drv_ring_vm_close,
+};
+
+static int drv_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct driver_private *dev;
+  struct drv_ring *ring;
+  struct usb_hcd *hcd;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+  int retval;
+
+  /* Restore driver private structure from the file handle */
+  dev = ((struct drv_file *)file->private_data)->dev;
+
+  mutex_lock(&dev->ring_mutex);
+  ring = dev->ring;
+  if(!ring)
+  {
+    retval = -ENXIO;
+    goto exit;
+  }
+
+  if(offset == STORAGE_RING_OFF_QUEUES && size <= ring->queues_bytes)
+  {
+    /* Queues live in vmalloc memory, mapped page by page */
+    retval = remap_vmalloc_range(vma, ring->hdr, 0);
+  }
+  else if(offset == STORAGE_RING_OFF_BUFFERS && size <= ring->buffers_bytes)
+  {
+    /* Buffers are DMA coherent, mapped the way usbfs maps its buffers */
+    hcd = bus_to_hcd(dev->usb_dev->bus);
+    vma->vm_pgoff = 0;
+    if(hcd->localmem_pool || !hcd_uses_dma(hcd))
+      retval = remap_pfn_range(vma, vma->vm_start, virt_to_phys(ring->buffers) >> PAGE_SHIFT,
+                               size, vma->vm_page_prot);
+    else
+      retval = dma_mmap_coherent(hcd->self.sysdev, vma, ring->buffers, ring->buffers_dma, size);
+  }
+  else
+  {
+    retval = -EINVAL;
+  }
+  if(retval < 0)
+    goto exit;
+
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+  vma->vm_ops = &drv_ring_vm_ops;
+  vma->vm_private_data = ring;
+  drv_ring_vm_open(vma);
+
+exit:
+  mutex_unlock(&dev->ring_mutex);
+  return retval;
+}
+
+static int drv_open(struct inode *inode, struct file *file)
+{
+  struct driver_private *dev;
+  struct drv_file *ctx;
+  struct usb_interface *interface;
+  int subminor;
+
+  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+
+  /* Find minor from the Inode */
+  subminor  = iminor(inode);
+
+  /* Get usb_interface reference of the usb_driver */
+  interface = usb_find_interface(&usb_drv, subminor);
+  if(!interface) 
+  {
+    pr_err("Could not find device with minor %d\r\n", subminor);
+    return -ENODEV;
+  }
+
+  /* Save usb_driver's private structure to a local copy */
+  dev = usb_get_intfdata(interface);
+  if(!dev)
+    return -ENODEV;
+
+  /* Every handle gets its own context, it lives on while its writes are in flight */
+  ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+  if(!ctx)
+    return -ENOMEM;
+  kref_init(&ctx->kref);
+  ctx->dev = dev;
+  /* Best effort with the default weight and no caps until STORAGE_IOC_SET_QOS */
+  ctx->qos.prio_class = STORAGE_QOS_CLASS_BE;
+  ctx->qos.weight = DRV_QOS_WEIGHT_DEFAULT;
+
+  /* Prevents the device from getting autosuspended until call is made to
+     usb_autopm_put_interface() */
+  if(usb_autopm_get_interface(interface))
+  {
+    kfree(ctx);
+    return -ENODEV;
+  }
+
+  /* Increment usage count for the device */
+  kref_get(&dev->kref);
+
+  /* Count the opener so that the read engine stops with the last one */
+  mutex_lock(&dev->read_mutex);
+  mutex_lock(&dev->io_mutex);
+  dev->open_count++;
+  /* In always armed mode data starts flowing into the pool right away */
+  if(rx_always_armed && !drv_raw_usable(dev) && !dev->disconnected && !dev->bulk_in_running)
+    drv_read_start(dev);
+  mutex_unlock(&dev->io_mutex);
+  mutex_unlock(&dev->read_mutex);
+
+  /* Save the handle context in the file's private structure */
+  file->private_data = ctx;
+  return 0;
+}
+
+static int drv_release(struct inode *inode, struct file *file)
+{
+  struct drv_file *ctx = file->private_data;
+  struct driver_private *dev;
+
+  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+
+  /* Restore driver private structure from the file handle */
+  if(NULL == ctx)
+    return -ENODEV;
+  dev = ctx->dev;
+
+  /* The last opener takes the read engine down */
+  mutex_lock(&dev->read_mutex);
+  mutex_lock(&dev->io_mutex);
+  if(!--dev->open_count)
+    drv_read_stop(dev);
+  /* Allow the device to be autosuspended */
+  if(!dev->disconnected)
+    usb_autopm_put_interface(dev->usb_intf);
+  mutex_unlock(&dev->io_mutex);
+  mutex_unlock(&dev->read_mutex);
+
+  /* The last opener also takes the transfer ring down, no mapping is left */
+  mutex_lock(&dev->ring_mutex);
+  if(!dev->open_count)
+    drv_ring_destroy(dev);
+  mutex_unlock(&dev->ring_mutex);
+
+  /* The handle context goes once the writes still in flight complete */
+  kref_put(&ctx->kref, drv_file_free);
+  /* Decrement usage count for the device */
+  kref_put(&dev->kref, usb_cleanup);
+  return 0;
+}
+
+static struct file_operations storage_ops = 
+{
+  .owner   = THIS_MODULE,
+  .read_iter  = drv_read_iter,
+  .write_iter = drv_write_iter,
+  .open    = drv_open,
+  .flush   = drv_flush,
+  .fsync   = drv_fsync,
+  .poll    = drv_poll,
+  .unlocked_ioctl = drv_ioctl,
+  .compat_ioctl   = compat_ptr_ioctl,
+  .mmap    = drv_mmap,
+  .release = drv_release,
+};
+
+/* Per-request data of the block device, the request's segments are mapped here */
+struct drv_blk_cmd
+{
+  struct scatterlist sg[DRV_BLK_MAX_SEGMENTS];
+  /* CDB and command built from the request */
+  u8 cdb[16];
+  struct drv_scsi_cmd scsi;
+  /* Tagged command slot, only used on UAS */
+  struct drv_uas_cmd uas;
+};
+
+static int drv_blk_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                                unsigned int hctx_idx, unsigned int numa_node)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+
+  sg_init_table(pdu->sg, DRV_BLK_MAX_SEGMENTS);
+  return 0;
+}
+
+/* Turn one read or write request into a READ/WRITE CDB in its pdu */
+static blk_status_t drv_blk_prep(struct driver_private *dev, struct request *rq)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+  struct drv_scsi_cmd *cmd = &pdu->scsi;
+  unsigned int nr_blocks;
+  bool is_write;
+  sector_t lba;
+
+  switch(req_op(rq))
+  {
+  case REQ_OP_READ:
+  case REQ_OP_WRITE:
+    break;
+  default:
+    return BLK_STS_NOTSUPP;
+  }
+  is_write = (req_op(rq) == REQ_OP_WRITE);
+
+  lba = blk_rq_pos(rq) >> (dev->blk_shift - SECTOR_SHIFT);
+  nr_blocks = blk_rq_bytes(rq) >> dev->blk_shift;
+
+  /* READ(10)/WRITE(10) cover the first 2 TiB of 512 byte blocks */
+  memset(pdu->cdb, 0, sizeof(pdu->cdb));
+  if(lba + nr_blocks <= 0xffffffffULL)
+  {
+    pdu->cdb[0] = is_write ? WRITE_10 : READ_10;
+    put_unaligned_be32(lba, &pdu->cdb[2]);
+    put_unaligned_be16(nr_blocks, &pdu->cdb[7]);
+    cmd->cdb_len = 10;
+  }
+  else
+  {
+    pdu->cdb[0] = is_write ? WRITE_16 : READ_16;
+    put_unaligned_be64(lba, &pdu->cdb[2]);
+    put_unaligned_be32(nr_blocks, &pdu->cdb[10]);
+    cmd->cdb_len = 16;
+  }
+
+  cmd->cdb = pdu->cdb;
+  cmd->lun = 0;
+  cmd->dir = is_write ? STORAGE_DIR_OUT : STORAGE_DIR_IN;
+  cmd->sg = pdu->sg;
+  cmd->nents = blk_rq_map_sg(rq->q, rq, pdu->sg);
+  cmd->len = blk_rq_bytes(rq);
+  cmd->timeout = msecs_to_jiffies(DRV_BOT_TIMEOUT_MS);
+  cmd->sense = NULL;
+  cmd->sense_len = 0;
+  return BLK_STS_OK;
+}
+
+/* Map the outcome of a request's command to a block layer status */
+static blk_status_t drv_blk_status(struct driver_private *dev, struct request *rq, int retval)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+  struct drv_scsi_cmd *cmd = &pdu->scsi;
+
+  if(!retval && cmd->status == US_BULK_STAT_OK && !cmd->residue)
+    return BLK_STS_OK;
+
+  dev_err_ratelimited(&dev->usb_intf->dev,"%s - %s of %u bytes at sector %llu failed, error %d status %u residue %u\n",
+                      __func__, (cmd->dir == STORAGE_DIR_OUT) ? "Write" : "Read", cmd->len,
+                      (unsigned long long)blk_rq_pos(rq), retval, cmd->status, cmd->residue);
+  return BLK_STS_IOERR;
+}
+
+/* Bulk-Only runs one command at a time, the queue is BLK_MQ_F_BLOCKING so we may sleep */
+static blk_status_t drv_blk_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+  struct driver_private *dev = hctx->queue->queuedata;
+  struct request *rq = bd->rq;
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+  unsigned int noio_flags;
+  blk_status_t status;
+  int retval;
+
+  status = drv_blk_prep(dev, rq);
+  if(status != BLK_STS_OK)
+    return status;
+
+  blk_mq_start_request(rq);
+
+  /* usb_bulk_msg() allocates with GFP_KERNEL, keep reclaim away from our own queue */
+  noio_flags = memalloc_noio_save();
+  mutex_lock(&dev->cmd_mutex);
+  retval = drv_bot_transport(dev, &pdu->scsi);
+  mutex_unlock(&dev->cmd_mutex);
+  memalloc_noio_restore(noio_flags);
+
+  blk_mq_end_request(rq, drv_blk_status(dev, rq, retval));
+  return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops drv_blk_mq_ops =
+{
+  .queue_rq     = drv_blk_queue_rq,
+  .init_request = drv_blk_init_request,
+};
+
+/* Last URB of a tagged command is back, may run in interrupt context */
+static void drv_uas_blk_done(struct drv_uas_cmd *uas)
+{
+  struct request *rq = blk_mq_rq_from_pdu(container_of(uas, struct drv_blk_cmd, uas));
+
+  blk_mq_end_request(rq, drv_blk_status(uas->dev, rq, uas->result));
+}
+
+/* UAS submits the request on the stream of its tag and returns, the
+   completion of its URBs ends it, so many commands run side by side */
+static blk_status_t drv_uas_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+  struct driver_private *dev = hctx->queue->queuedata;
+  struct request *rq = bd->rq;
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+  blk_status_t status;
+
+  status = drv_blk_prep(dev, rq);
+  if(status != BLK_STS_OK)
+    return status;
+
+  /* Stream 1 is taken by synchronous commands */
+  pdu->uas.tag = rq->tag + 2;
+  pdu->uas.scsi = &pdu->scsi;
+
+  blk_mq_start_request(rq);
+  drv_uas_submit(&pdu->uas, GFP_ATOMIC);
+  return BLK_STS_OK;
+}
+
+/* Cancel the URBs of a command the device sits on, its completion ends the request */
+static enum blk_eh_timer_return drv_uas_timeout(struct request *rq)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+
+  drv_uas_abort(&pdu->uas, -ETIMEDOUT);
+  return BLK_EH_RESET_TIMER;
+}
+
+static int drv_uas_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                                unsigned int hctx_idx, unsigned int numa_node)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+
+  sg_init_table(pdu->sg, DRV_BLK_MAX_SEGMENTS);
+  pdu->uas.done = drv_uas_blk_done;
+  return drv_uas_cmd_init(set->driver_data, &pdu->uas, GFP_KERNEL);
+}
+
+static void drv_uas_exit_request(struct blk_mq_tag_set *set, struct request *rq,
+                                 unsigned int hctx_idx)
+{
+  struct drv_blk_cmd *pdu = blk_mq_rq_to_pdu(rq);
+
+  drv_uas_cmd_free(&pdu->uas);
+}
+
+static const struct blk_mq_ops drv_uas_mq_ops =
+{
+  .queue_rq     = drv_uas_queue_rq,
+  .timeout      = drv_uas_timeout,
+  .init_request = drv_uas_init_request,
+  .exit_request = drv_uas_exit_request,
+};
+
+static const struct block_device_operations drv_blk_ops =
+{
+  .owner = THIS_MODULE,
+};
+
+/* Size the medium of LUN 0, READ CAPACITY(16) is used past 2^32 blocks */
+static int drv_blk_read_capacity(struct driver_private *dev)
+{
+  struct drv_scsi_cmd cmd;
+  struct scatterlist sg;
+  u8 cdb[16];
+  u8 *buffer;
+  u64 last_lba;
+  u32 block_size;
+  int tries;
+  int retval;
+
+  buffer = kmalloc(32, GFP_KERNEL);
+  if(!buffer)
+    return -ENOMEM;
+
+  /* The first commands after attach typically fail with a UNIT ATTENTION */
+  for(tries = 0; tries < 3; tries++)
+  {
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = READ_CAPACITY;
+    sg_init_one(&sg, buffer, 8);
+    cmd.cdb = cdb;
+    cmd.cdb_len = 10;
+    cmd.lun = 0;
+    cmd.dir = STORAGE_DIR_IN;
+    cmd.sg = &sg;
+    cmd.nents = 1;
+    cmd.len = 8;
+    cmd.timeout = msecs_to_jiffies(DRV_BOT_TIMEOUT_MS);
+    cmd.sense = NULL;
+    cmd.sense_len = 0;
+
+    mutex_lock(&dev->cmd_mutex);
+    retval = drv_scsi_transport(dev, &cmd);
+    mutex_unlock(&dev->cmd_mutex);
+    if(!retval && cmd.status == US_BULK_STAT_OK && !cmd.residue)
+      break;
+    retval = retval ? retval : -EIO;
+  }
+  if(retval)
+    goto exit;
+
+  last_lba = get_unaligned_be32(&buffer[0]);
+  block_size = get_unaligned_be32(&buffer[4]);
+
+  if(last_lba == 0xffffffff)
+  {
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = SERVICE_ACTION_IN_16;
+    cdb[1] = SAI_READ_CAPACITY_16;
+    put_unaligned_be32(32, &cdb[10]);
+    sg_init_one(&sg, buffer, 32);
+    cmd.cdb_len = 16;
+    cmd.len = 32;
+
+    mutex_lock(&dev->cmd_mutex);
+    retval = drv_scsi_transport(dev, &cmd);
+    mutex_unlock(&dev->cmd_mutex);
+    if(retval || cmd.status != US_BULK_STAT_OK || cmd.len - cmd.residue < 12)
+    {
+      retval = retval ? retval : -EIO;
+      goto exit;
+    }
+    last_lba = get_unaligned_be64(&buffer[0]);
+    block_size = get_unaligned_be32(&buffer[8]);
+  }
+
+  /* Some controllers report the block count where the last block belongs */
+  if((dev->profile->quirks & DRV_QUIRK_FIX_CAPACITY) && last_lba)
+    last_lba--;
+
+  if(block_size < SECTOR_SIZE || block_size > PAGE_SIZE || !is_power_of_2(block_size))
+  {
+    dev_err(&dev->usb_intf->dev,"%s - Unsupported block size %u\n",__func__, block_size);
+    retval = -EINVAL;
+    goto exit;
+  }
+  dev->blk_shift = ilog2(block_size);
+  dev->blk_capacity = (last_lba + 1) << (dev->blk_shift - SECTOR_SHIFT);
+exit:
+  kfree(buffer);
+  return retval;
+}
+
+/* Largest request in 512 byte sectors, usb-storage's defaults unless overridden */
+static unsigned int drv_blk_max_sectors(struct driver_private *dev)
+{
+  size_t max_mapping = dma_max_mapping_size(dev->usb_dev->bus->sysdev);
+  unsigned int max_sectors;
+
+  if(drv_tune(dev, blk_max_sectors))
+    max_sectors = drv_tune(dev, blk_max_sectors);
+  else
+    max_sectors = (dev->usb_dev->speed >= USB_SPEED_SUPER) ? 2048 : 240;
+
+  /* Bounded by what the DMA layer can map and the segments of one request */
+  max_sectors = min_t(size_t, max_sectors, max_mapping >> SECTOR_SHIFT);
+  max_sectors = min_t(unsigned int, max_sectors, DRV_BLK_MAX_SEGMENTS * (PAGE_SIZE >> SECTOR_SHIFT));
+  return max(max_sectors, (unsigned int)(PAGE_SIZE >> SECTOR_SHIFT));
+}
+
+/* Register the usbflash%d disk in front of the Bulk-Only Transport */
+static int drv_blk_create(struct driver_private *dev)
+{
+  struct queue_limits lim = {};
+  struct gendisk *disk;
+  int retval;
+
+  retval = drv_blk_read_capacity(dev);
+  if(retval < 0)
+    return retval;
+
+  lim.logical_block_size = 1 << dev->blk_shift;
+  lim.max_hw_sectors = drv_blk_max_sectors(dev);
+  lim.max_segments = DRV_BLK_MAX_SEGMENTS;
+
+  dev->tag_set.nr_hw_queues = 1;
+  dev->tag_set.numa_node = NUMA_NO_NODE;
+  dev->tag_set.cmd_size = sizeof(struct drv_blk_cmd);
+  dev->tag_set.driver_data = dev;
+  if(dev->uas)
+  {
+    /* One data URB carries the whole list, so the host's limit applies */
+    lim.max_segments = min_t(unsigned int, lim.max_segments, dev->usb_dev->bus->sg_tablesize);
+    /* Every tag owns a stream, minus the one of synchronous commands */
+    dev->tag_set.ops = &drv_uas_mq_ops;
+    dev->tag_set.queue_depth = clamp(drv_tune(dev, blk_queue_depth), 1U, dev->uas_streams - 1);
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+  }
+  else
+  {
+    /* Without scatter-gather each segment becomes its own URB and a short
+       packet in the middle would end the transfer early */
+    if(!dev->usb_dev->bus->no_sg_constraint)
+      lim.virt_boundary_mask = dev->bulk_in_max_size - 1;
+    dev->tag_set.ops = &drv_blk_mq_ops;
+    dev->tag_set.queue_depth = clamp(drv_tune(dev, blk_queue_depth), 1U, (unsigned int)BLK_MQ_MAX_DEPTH);
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+  }
+
+  retval = blk_mq_alloc_tag_set(&dev->tag_set);
+  if(retval < 0)
+    return retval;
+
+  disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
+  if(IS_ERR(disk))
+  {
+    retval = PTR_ERR(disk);
+    goto exit_tag_set;
+  }
+
+  dev->disk_index = ida_alloc(&drv_blk_ida, GFP_KERNEL);
+  if(dev->disk_index < 0)
+  {
+    retval = dev->disk_index;
+    goto exit_disk;
+  }
+
+  disk->fops = &drv_blk_ops;
+  disk->private_data = dev;
+  snprintf(disk->disk_name, DISK_NAME_LEN, "usbflash%d", dev->disk_index);
+  set_capacity(disk, dev->blk_capacity);
+
+  retval = device_add_disk(&dev->usb_intf->dev, disk, NULL);
+  if(retval < 0)
+    goto exit_ida;
+
+  dev->disk = disk;
+  dev_info(&dev->usb_intf->dev, "%s : %llu sectors of %u bytes\r\n", disk->disk_name,
+           (unsigned long long)(dev->blk_capacity >> (dev->blk_shift - SECTOR_SHIFT)), 1U << dev->blk_shift);
+  return 0;
+
+exit_ida:
+  ida_free(&drv_blk_ida, dev->disk_index);
+exit_disk:
+  put_disk(disk);
+exit_tag_set:
+  blk_mq_free_tag_set(&dev->tag_set);
+  return retval;
+}
+
+/* Remove the disk, requests still queued fail against the departed device */
+static void drv_blk_destroy(struct driver_private *dev)
+{
+  if(!dev->disk)
+    return;
+
+  del_gendisk(dev->disk);
+  blk_mq_free_tag_set(&dev->tag_set);
+  put_disk(dev->disk);
+  ida_free(&drv_blk_ida, dev->disk_index);
+  dev->disk = NULL;
+}
+
+/* Device of the interface the statistics hang off, NULL once it is gone */
+static struct driver_private *drv_stats_dev(struct device *idev)
+{
+  return usb_get_intfdata(to_usb_interface(idev));
+}
+
+/* Sum one counter over all CPUs */
+static u64 drv_stats_sum(struct driver_private *dev, size_t offset)
+{
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    sum += *(u64 *)((char *)per_cpu_ptr(dev->stats, cpu) + offset);
+  return sum;
+}
+
+#define DRV_STAT_ATTR(_name, _member)                                                     \
+static ssize_t _name##_show(struct device *idev, struct device_attribute *attr, char *buf) \
+{                                                                                          \
+  struct driver_private *dev = drv_stats_dev(idev);                                        \
+                                                                                           \
+  if(!dev)                                                                                 \
+    return -ENODEV;                                                                        \
+  return sysfs_emit(buf, "%llu\n", drv_stats_sum(dev, offsetof(struct drv_stats, _member))); \
+}                                                                                          \
+static DEVICE_ATTR_RO(_name)
+
+DRV_STAT_ATTR(read_bytes, bytes[DRV_STAT_READ]);
+DRV_STAT_ATTR(write_bytes, bytes[DRV_STAT_WRITE]);
+DRV_STAT_ATTR(read_urbs, urbs[DRV_STAT_READ]);
+DRV_STAT_ATTR(write_urbs, urbs[DRV_STAT_WRITE]);
+DRV_STAT_ATTR(read_errors, errors[DRV_STAT_READ]);
+DRV_STAT_ATTR(write_errors, errors[DRV_STAT_WRITE]);
+DRV_STAT_ATTR(read_stalls, stalls[DRV_STAT_READ]);
+DRV_STAT_ATTR(write_stalls, stalls[DRV_STAT_WRITE]);
+
+/* Current and peak in-flight depth of each direction, one per line */
+static ssize_t inflight_show(struct device *idev, struct device_attribute *attr, char *buf)
+{
+  struct driver_private *dev = drv_stats_dev(idev);
+
+  if(!dev)
+    return -ENODEV;
+  return sysfs_emit(buf, "%d %d\n%d %d\n",
+                    atomic_read(&dev->stat_inflight[DRV_STAT_READ]),
+                    atomic_read(&dev->stat_inflight_max[DRV_STAT_READ]),
+                    atomic_read(&dev->stat_inflight[DRV_STAT_WRITE]),
+                    atomic_read(&dev->stat_inflight_max[DRV_STAT_WRITE]));
+}
+static DEVICE_ATTR_RO(inflight);
+
+/* Bulk endpoints of the interface, one per line : address, max packet size,
+   URBs in flight and bytes moved, the striped pairs are marked with a '*' */
+static ssize_t endpoints_show(struct device *idev, struct device_attribute *attr, char *buf)
+{
+  struct driver_private *dev = drv_stats_dev(idev);
+  struct drv_bulk_ep *ep;
+  ssize_t len = 0;
+  unsigned int ii;
+  int dir;
 
-  /* URB used for receiving data from bulk_in endpoint */
-  struct urb *bulk_in_urb;
-  /* Structure used to maintain the state of completion of an event */
-  struct completion bulk_in_completion;
-  /* The address of the bulk_in endpoint */
-  unsigned int bulk_in_endpointAddr; 
-  /* Buffer to store received data */
-  unsigned char *bulk_in_buffer;
-  /* Max packet size of the bulk_in endpoint */
-  size_t bulk_in_max_size;
-  /* No of bytes actually read from bulk_in endpoint */
-  size_t bulk_in_read_bytes; 
-  /* Save the error state of URB used for reading from bulk_in endpoint */
-  int bulk_in_errors;
+  if(!dev)
+    return -ENODEV;
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+  {
+    for(ii = 0; ii < dev->nr_bulk_eps[dir]; ii++)
+    {
+      ep = &dev->bulk_eps[dir][ii];
+      len += sysfs_emit_at(buf, len, "0x%02x%c %zu %d %lld\n", ep->addr, (ii < dev->nr_stripes) ? '*' : ' ',
+                           ep->max_size, atomic_read(&ep->inflight), (long long)atomic64_read(&ep->bytes));
+    }
+  }
+  return len;
+}
+static DEVICE_ATTR_RO(endpoints);
 
-  /* URB used for sending data from bulk_out endpoint */
-  struct urb *bulk_out_urb;
-  /* Structure used to maintain the state of completion of an event */
-  struct completion bulk_out_completion;
-  /* The address of the bulk_out endpoint */
-  unsigned int bulk_out_endpointAddr; 
-  /* Buffer to store data for sending */
-  unsigned char *bulk_out_buffer;
-  /* Max packet size of the bulk_out endpoint */
-  size_t bulk_out_max_size;
-  /* No of bytes actually written to bulk_out endpoint */
-  size_t bulk_out_write_bytes; 
-  /* Save the error state of URB used for writing to bulk_out endpoint */
-  int bulk_out_errors;
-};
+/* Latency histogram, bucket 0 counts URBs under 1us and bucket N those
+   from 2^(N-1) up to 2^N us, the last bucket takes everything slower */
+static ssize_t drv_stats_latency_show(struct device *idev, char *buf, int dir)
+{
+  struct driver_private *dev = drv_stats_dev(idev);
+  ssize_t len = 0;
+  unsigned int ii;
 
-#define get_driver_private(ptr) container_of(ptr, struct driver_private, kref)
+  if(!dev)
+    return -ENODEV;
+  for(ii = 0; ii < DRV_LAT_BUCKETS; ii++)
+    len += sysfs_emit_at(buf, len, "%llu%c", drv_stats_sum(dev, offsetof(struct drv_stats, latency[dir][ii])),
+                         (ii == DRV_LAT_BUCKETS - 1) ? '\n' : ' ');
+  return len;
+}
 
-static void usb_cleanup(struct kref *kref)
+static ssize_t read_latency_show(struct device *idev, struct device_attribute *attr, char *buf)
 {
-  struct driver_private *dev;
- 
-  /* Fetch the parent private structure from kref field */
-  dev = get_driver_private(kref);
-  /* Decrement the kref count */
-  usb_put_dev(dev->usb_dev);
-  /* Free the memory allocated for bulk_in receive buffer */
-  kfree(dev->bulk_in_buffer);
-  /* Free the memory allocated for bulk_out transmit buffer */
-  kfree(dev->bulk_out_buffer);
-  /* Free the memory allocated for driver private structure */
-  kfree(dev);
+  return drv_stats_latency_show(idev, buf, DRV_STAT_READ);
 }
+static DEVICE_ATTR_RO(read_latency);
 
-/* Called when the submitted URB transfer is completed */
-static void drv_read_bulk_callback(struct urb *urb)
+static ssize_t write_latency_show(struct device *idev, struct device_attribute *attr, char *buf)
 {
-  struct driver_private *dev;
-  
-  /* Restore driver private structure from URB */
-  dev = urb->context;
+  return drv_stats_latency_show(idev, buf, DRV_STAT_WRITE);
+}
+static DEVICE_ATTR_RO(write_latency);
 
-  /* Check status of the URB transaction */
-  if(urb->status) 
-  {
-    if(!(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
-      dev_err(&dev->usb_intf->dev,"%s - nonzero write bulk status received: %d\n",__func__, urb->status);
+/* Writing anything clears the counters, the peaks restart from the current depth */
+static ssize_t reset_store(struct device *idev, struct device_attribute *attr, const char *buf, size_t count)
+{
+  struct driver_private *dev = drv_stats_dev(idev);
+  unsigned int ii;
+  int cpu;
+  int dir;
 
-    dev->bulk_in_errors = urb->status;
-  } 
-  else 
+  if(!dev)
+    return -ENODEV;
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct drv_stats));
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
   {
-    /* Save the number of bytes actually transferred */
-    dev->bulk_in_read_bytes = urb->actual_length;
+    atomic_set(&dev->stat_inflight_max[dir], atomic_read(&dev->stat_inflight[dir]));
+    for(ii = 0; ii < dev->nr_bulk_eps[dir]; ii++)
+      atomic64_set(&dev->bulk_eps[dir][ii].bytes, 0);
   }
-  /* Signal thread associated with read_completion to wake up */
-  complete(&dev->bulk_in_completion);
+  return count;
 }
+static DEVICE_ATTR_WO(reset);
 
-
-static ssize_t drv_read(struct file *file, char *buffer, size_t count, loff_t *off)
+static struct attribute *drv_stats_attrs[] =
 {
-  struct driver_private *dev;
-  int retval = 0;
+  &dev_attr_read_bytes.attr,
+  &dev_attr_write_bytes.attr,
+  &dev_attr_read_urbs.attr,
+  &dev_attr_write_urbs.attr,
+  &dev_attr_read_errors.attr,
+  &dev_attr_write_errors.attr,
+  &dev_attr_read_stalls.attr,
+  &dev_attr_write_stalls.attr,
+  &dev_attr_inflight.attr,
+  &dev_attr_endpoints.attr,
+  &dev_attr_read_latency.attr,
+  &dev_attr_write_latency.attr,
+  &dev_attr_reset.attr,
+  NULL,
+};
 
-  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+/* Path --> /sys/class/usbmisc/storage0/device/stats */
+static const struct attribute_group drv_stats_group =
+{
+  .name  = "stats",
+  .attrs = drv_stats_attrs,
+};
 
-  /* Restore driver private structure from file's private structure */
-  dev = file->private_data;
+/* Created by the driver core before the bind uevent, removed before disconnect */
+static const struct attribute_group *drv_groups[] =
+{
+  &drv_stats_group,
+  NULL,
+};
 
-  /* If we cannot read at all, return EOF */
-  if(!dev->bulk_in_urb || !count)
-    return 0;
+/* Self-test of the bulk pipeline, meant for a loopback peer such as g_zero */
+/* Path --> /sys/kernel/debug/usb/usb_flash_storage/storage0 */
 
-  /* Create an URB for the USB driver to use for data transfer */
-  /* For bulk endpoints, the first argument has to be 0 */
-  dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-  if (!dev->bulk_in_urb) 
-  {
-    dev_err(&dev->usb_dev->dev,"Could not allocate bulk_in_urb\n");
-    return -ENOMEM;
-  }
+/* Fill an OUT buffer with the pattern, mod63 restarts with every packet as in usbtest */
+static void drv_test_fill(struct driver_private *dev, u8 *buf, unsigned int len)
+{
+  unsigned int ii;
 
-  /* Allocate buffer to receive data */
-  dev->bulk_in_buffer = kmalloc(dev->bulk_in_max_size, GFP_KERNEL);
-  if (!dev->bulk_in_buffer)
+  if(dev->test.last.pattern == DRV_TEST_PATTERN_ZERO)
   {
-    dev_err(&dev->usb_dev->dev,"Could not allocate bulk_in_buffer\n");
+    memset(buf, 0, len);
+    return;
   }
+  for(ii = 0; ii < len; ii++)
+    buf[ii] = (ii % dev->bulk_out_max_size) % 63;
+}
 
-  /* Initialize URB */
-  usb_fill_bulk_urb(dev->bulk_in_urb, dev->usb_dev,
-                    usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr),
-                    dev->bulk_in_buffer, min(dev->bulk_in_max_size, count),
-                    drv_read_bulk_callback, dev);
+/* Check received data against the pattern, returns the first bad offset or -1 */
+static int drv_test_check(struct driver_private *dev, const u8 *buf, unsigned int len)
+{
+  unsigned int ii;
+  u8 expected;
 
-  /* Submit URB to receive data via bulk_in_urb */
-  retval = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
-  if(retval < 0) 
+  for(ii = 0; ii < len; ii++)
   {
-    dev_err(&dev->usb_dev->dev,"%s - Failed submitting read urb, error %d\n",__func__, retval);
+    expected = (dev->test.last.pattern == DRV_TEST_PATTERN_ZERO) ? 0 : (ii % dev->bulk_in_max_size) % 63;
+    if(buf[ii] != expected)
+      return ii;
   }
+  return -1;
+}
 
-  /* Wait for the task to complete */
-  retval = wait_for_completion_interruptible(&dev->bulk_in_completion);
-  if(retval < 0)
-    goto exit;
-	
-  /* Copy data read to user buffer and return the number of bytes read */
-  if(copy_to_user(buffer, dev->bulk_in_buffer, dev->bulk_in_read_bytes))
-    retval = -EFAULT;
-  else
-    retval = dev->bulk_in_read_bytes;
-exit:
-  return retval;
+/* Stop both lanes and keep the first error, called with test->lock held */
+static void drv_test_stop(struct drv_test *test, int error)
+{
+  int dir;
+
+  if(!test->status)
+    test->status = error;
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+    test->lane[dir].to_submit = 0;
 }
 
-/* Called when the submitted URB transfer is completed */
-static void drv_write_bulk_callback(struct urb *urb)
+static void drv_test_fail(struct drv_test *test, int error)
 {
-  struct driver_private *dev;
+  spin_lock_irq(&test->lock);
+  drv_test_stop(test, error);
+  spin_unlock_irq(&test->lock);
+}
 
-  /* Restore driver private structure from URB */
-  dev = urb->context;
+/* Check whether any URB of the run is in flight or still to be submitted */
+static bool drv_test_busy(struct drv_test *test)
+{
+  bool busy;
+  int dir;
 
-  /* Check status of the URB transaction */
-  if(urb->status) 
-  {
-    if(!(urb->status == -ENOENT ||urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
-      dev_err(&dev->usb_intf->dev,"%s - Non zero write bulk status received: %d\n",__func__, urb->status);
+  spin_lock_irq(&test->lock);
+  for(busy = false, dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+    busy |= test->lane[dir].inflight || test->lane[dir].to_submit;
+  spin_unlock_irq(&test->lock);
+  return busy;
+}
 
-    dev->bulk_in_errors = urb->status;
-  }
+/* No of URBs of the run completed so far, tells a stall from slow progress */
+static u64 drv_test_completed(struct drv_test *test)
+{
+  u64 done;
 
-  /* Free up the allocated buffer */
-  usb_free_coherent(urb->dev, urb->transfer_buffer_length, urb->transfer_buffer, urb->transfer_dma);
+  spin_lock_irq(&test->lock);
+  done = test->lane[DRV_STAT_READ].urbs + test->lane[DRV_STAT_READ].errors +
+         test->lane[DRV_STAT_WRITE].urbs + test->lane[DRV_STAT_WRITE].errors;
+  spin_unlock_irq(&test->lock);
+  return done;
 }
 
-static ssize_t drv_write(struct file *file, const char *user_buffer, size_t count, loff_t *off)
+static void drv_test_callback(struct urb *urb);
+
+/* Post one self-test transfer on the bulk endpoint of its lane */
+static int drv_test_submit(struct driver_private *dev, struct drv_xfer *xfer, int dir, gfp_t gfp)
 {
-  struct driver_private *dev;
-  int retval = 0;
+  unsigned int pipe;
+  int retval;
 
-  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+  pipe = (dir == DRV_STAT_READ) ? usb_rcvbulkpipe(dev->usb_dev, dev->bulk_in_endpointAddr)
+                                : usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr);
+  usb_fill_bulk_urb(xfer->urb, dev->usb_dev, pipe, xfer->buffer, dev->test.last.size,
+                    drv_test_callback, xfer);
+  usb_anchor_urb(xfer->urb, &dev->test.anchor);
 
-  /* Restore driver private structure from file's private structure */
-  dev = file->private_data;
+  drv_urb_submit(dev, xfer->urb, &xfer->stamp);
+  retval = usb_submit_urb(xfer->urb, gfp);
+  if(retval < 0)
+  {
+    drv_urb_submit_failed(dev, xfer->urb, &xfer->stamp, retval);
+    usb_unanchor_urb(xfer->urb);
+  }
+  return retval;
+}
 
-  /* Fill up the number of bytes to write */
-  dev->bulk_out_write_bytes = count;
+/* Called when a self-test URB is completed, posts it again while its lane has iterations left */
+static void drv_test_callback(struct urb *urb)
+{
+  struct drv_xfer *xfer = urb->context;
+  struct driver_private *dev = xfer->dev;
+  struct drv_test *test = &dev->test;
+  int dir = usb_pipein(urb->pipe) ? DRV_STAT_READ : DRV_STAT_WRITE;
+  struct drv_test_lane *lane = &test->lane[dir];
+  unsigned long flags;
+  bool again = false;
+  int offset = -1;
+  int retval;
 
-  /* Verify that we actually have some data to write */
-  if(count == 0)
-    goto exit;
+  drv_urb_complete(dev, urb, &xfer->stamp);
 
-  /* Create an URB for the USB driver to use for data transfer */
-  /* For bulk endpoints, the first argument has to be 0 */
-  dev->bulk_out_urb = usb_alloc_urb(0, GFP_KERNEL);
-  if(NULL == dev->bulk_out_urb) 
+  /* The buffer belongs to this URB until it is posted again, check it unlocked */
+  if(!urb->status && dir == DRV_STAT_READ)
   {
-    retval = -ENOMEM;
-    goto error;
+    offset = drv_test_check(dev, xfer->buffer, urb->actual_length);
+    if(offset < 0 && urb->actual_length != urb->transfer_buffer_length)
+      offset = urb->actual_length;
   }
 
-  /* Allocate DMA coherent buffer to transfer payload */
-  dev->bulk_out_buffer = usb_alloc_coherent(dev->usb_dev, dev->bulk_out_write_bytes, GFP_KERNEL, &dev->bulk_out_urb->transfer_dma);
-  if(!dev->bulk_out_buffer) 
+  spin_lock_irqsave(&test->lock, flags);
+  lane->inflight--;
+  if(urb->status)
   {
-    retval = -ENOMEM;
-    goto error;
+    /* URBs cancelled by the runner are not counted, the run already failed */
+    if(!(urb->status == -ENOENT || urb->status == -ECONNRESET))
+      lane->errors++;
+    drv_test_stop(test, urb->status);
+  }
+  else
+  {
+    lane->urbs++;
+    lane->bytes += urb->actual_length;
+    if(offset >= 0)
+    {
+      lane->mismatches++;
+      if(test->mismatch_offset < 0)
+        test->mismatch_offset = offset;
+      drv_test_stop(test, -EILSEQ);
+    }
+  }
+  if(lane->to_submit)
+  {
+    lane->to_submit--;
+    lane->inflight++;
+    again = true;
   }
+  spin_unlock_irqrestore(&test->lock, flags);
 
-  /* Write payload(usb device class protocol) into dma buffer */
-  if(copy_from_user(dev->bulk_out_buffer, user_buffer, dev->bulk_out_write_bytes)) 
+  if(again)
   {
-    retval = -EFAULT;
-    goto error;
+    retval = drv_test_submit(dev, xfer, dir, GFP_ATOMIC);
+    if(retval < 0)
+    {
+      spin_lock_irqsave(&test->lock, flags);
+      lane->inflight--;
+      drv_test_stop(test, retval);
+      spin_unlock_irqrestore(&test->lock, flags);
+      again = false;
+    }
   }
 
-  /* Initialize URB */
-  usb_fill_bulk_urb(dev->bulk_out_urb, dev->usb_dev,
-                    usb_sndbulkpipe(dev->usb_dev, dev->bulk_out_endpointAddr),
-                    dev->bulk_out_buffer, dev->bulk_out_write_bytes, 
-                    drv_write_bulk_callback, dev);
-        
-  dev->bulk_out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+  /* The transfer goes back to the pool once its lane is done with it */
+  if(!again)
+    drv_pool_put(dev, xfer);
+  wake_up(&test->wait);
+}
 
-  /* FIXME: Fails with Error Code -ENOENT */
-  /* Send the data out the bulk port */
-  retval = usb_submit_urb(dev->bulk_out_urb, GFP_KERNEL);
-  if(retval) 
+/* Run one self-test with the parameters set in debugfs, raw I/O is quiesced
+   for the whole run as it shares the bulk endpoints */
+static int drv_test_run(struct driver_private *dev, int mode)
+{
+  struct drv_test *test = &dev->test;
+  struct drv_xfer *xfer;
+  unsigned int lanes = hweight32(mode);
+  unsigned int ii;
+  u64 completed;
+  u64 start;
+  long left;
+  int dir;
+  int retval;
+
+  /* The bulk pair of raw transfers is gone or owned by the block device */
+  retval = drv_raw_usable(dev);
+  if(retval < 0)
+    return retval;
+  /* Raw traffic would land in the middle of the run */
+  retval = drv_raw_quiesce(dev);
+  if(retval < 0)
+    return retval;
+
+  /* Validate the parameters, a transfer never outgrows its pool buffer */
+  test->last = test->params;
+  if(!test->last.size || !test->last.iterations || test->last.pattern > DRV_TEST_PATTERN_MOD63)
   {
-    dev_err(&dev->usb_intf->dev,"%s - Failed submitting write urb, error %d\n",__func__, retval);
-    goto error_unanchor;
+    retval = -EINVAL;
+    goto exit;
   }
+  test->last.size = min_t(u32, test->last.size, dev->pool_buffer_size);
+  test->last.queue_depth = clamp_t(u32, test->last.queue_depth, 1, dev->pool_nr_xfers / lanes);
 
-  /* Release our reference to this URB, the USB core will eventually free it entirely */
-  usb_free_urb(dev->bulk_out_urb);
+  /* So would SCSI batches */
+  mutex_lock(&dev->cmd_mutex);
 
-  /* Return the number of bytes written */
-  return dev->bulk_out_write_bytes;
+  memset(test->lane, 0, sizeof(test->lane));
+  test->mode = mode;
+  test->status = 0;
+  test->mismatch_offset = -1;
+  for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+    if(mode & BIT(dir))
+      test->lane[dir].to_submit = test->last.iterations;
 
-error_unanchor:
-  usb_unanchor_urb(dev->bulk_out_urb);
+  /* Prime queue_depth URBs on each lane, OUT buffers keep their pattern for the whole run */
+  start = ktime_get_ns();
+  for(ii = 0; ii < test->last.queue_depth; ii++)
+  {
+    for(dir = 0; dir < DRV_STAT_NR_DIRS; dir++)
+    {
+      spin_lock_irq(&test->lock);
+      if(!test->lane[dir].to_submit)
+      {
+        spin_unlock_irq(&test->lock);
+        continue;
+      }
+      test->lane[dir].to_submit--;
+      test->lane[dir].inflight++;
+      spin_unlock_irq(&test->lock);
 
-error:
-  if(dev->bulk_out_urb)
+      xfer = drv_pool_get(dev);
+      if(xfer && dir == DRV_STAT_WRITE)
+        drv_test_fill(dev, xfer->buffer, test->last.size);
+      retval = xfer ? drv_test_submit(dev, xfer, dir, GFP_KERNEL) : -EBUSY;
+      if(retval < 0)
+      {
+        if(xfer)
+          drv_pool_put(dev, xfer);
+        spin_lock_irq(&test->lock);
+        test->lane[dir].inflight--;
+        drv_test_stop(test, retval);
+        spin_unlock_irq(&test->lock);
+      }
+    }
+  }
+
+  /* Wait for the lanes to drain, a failure, a signal or a stall cancels the rest */
+  while(drv_test_busy(test))
   {
-    usb_free_coherent(dev->usb_dev, dev->bulk_out_write_bytes, dev->bulk_out_buffer, dev->bulk_out_urb->transfer_dma);
-    usb_free_urb(dev->bulk_out_urb);
+    completed = drv_test_completed(test);
+    left = wait_event_interruptible_timeout(test->wait, !drv_test_busy(test) || READ_ONCE(test->status),
+                                            msecs_to_jiffies(DRV_TEST_STALL_MS));
+    if(left < 0)
+      drv_test_fail(test, -EINTR);
+    else if(!left && drv_test_completed(test) == completed)
+      drv_test_fail(test, -ETIMEDOUT);
+    if(READ_ONCE(test->status))
+      usb_kill_anchored_urbs(&test->anchor);
   }
+  test->elapsed_ns = ktime_get_ns() - start;
+
+  /* Also waits for the last completion handler to return */
+  usb_kill_anchored_urbs(&test->anchor);
+  mutex_unlock(&dev->cmd_mutex);
+  retval = 0;
 
 exit:
+  drv_raw_resume(dev);
   return retval;
 }
- 
-static int drv_open(struct inode *inode, struct file *file)
-{
-  struct driver_private *dev;
-  struct usb_interface *interface;
-  int subminor;
 
-  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+/* Writing out, in or loopback starts a run and returns once it is over */
+static ssize_t drv_test_run_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+  struct driver_private *dev = file->private_data;
+  char cmd[16];
+  int mode;
+  int retval;
 
-  /* Find minor from the Inode */
-  subminor  = iminor(inode);
+  if(count >= sizeof(cmd))
+    return -EINVAL;
+  if(copy_from_user(cmd, ubuf, count))
+    return -EFAULT;
+  cmd[count] = '\0';
 
-  /* Get usb_interface reference of the usb_driver */
-  interface = usb_find_interface(&usb_drv, subminor);
-  if(!interface) 
-  {
-    pr_err("Could not find device with minor %d\r\n", subminor);
-    return -ENODEV;
-  }
+  if(sysfs_streq(cmd, "out"))
+    mode = DRV_TEST_OUT;
+  else if(sysfs_streq(cmd, "in"))
+    mode = DRV_TEST_IN;
+  else if(sysfs_streq(cmd, "loopback"))
+    mode = DRV_TEST_LOOPBACK;
+  else
+    return -EINVAL;
 
-  /* Save usb_driver's private structure to a local copy */
-  dev = usb_get_intfdata(interface);
-  if(!dev)
-    return -ENODEV;
+  retval = drv_test_run(dev, mode);
+  return retval < 0 ? retval : count;
+}
 
-  /* FIXME : Causes errors which are reflected in dmesg log */
-  /* Increment usage count for the device */
-  kref_get(&dev->kref);
+static const struct file_operations drv_test_run_fops =
+{
+  .owner  = THIS_MODULE,
+  .open   = simple_open,
+  .write  = drv_test_run_write,
+  .llseek = noop_llseek,
+};
 
-  /* Prevents the device from getting autosuspended until call is made to
-     usb_autopm_set_interface() */
-  if(!usb_autopm_get_interface(interface))
-    return -ENODEV;
+/* Throughput of one lane in MB/s with two decimals */
+static void drv_test_show_lane(struct seq_file *s, const char *name, struct drv_test_lane *lane, u64 elapsed_ns)
+{
+  u64 rate = elapsed_ns ? div64_u64(lane->bytes * 100000, elapsed_ns) : 0;
 
-  /* Save driver private structure in the file's private structure */
-  file->private_data = dev;
-  return 0;
+  seq_printf(s, "%s_urbs: %llu\n%s_bytes: %llu\n%s_errors: %llu\n%s_mbps: %llu.%02llu\n",
+             name, lane->urbs, name, lane->bytes, name, lane->errors, name, div_u64(rate, 100), rate % 100);
 }
 
-static int drv_release(struct inode *inode, struct file *file)
+/* Parameters and outcome of the last run, status is 0 or the first error */
+static int drv_test_result_show(struct seq_file *s, void *unused)
 {
-  struct driver_private *dev;
-
-  pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+  struct driver_private *dev = s->private;
+  struct drv_test *test = &dev->test;
+  int retval;
 
-  /* Restore driver private structure from file's private structure */
-  dev = file->private_data;
-  if(NULL == dev)
-    return -ENODEV;
+  /* A running test is waited for */
+  retval = mutex_lock_interruptible(&dev->io_mutex);
+  if(retval < 0)
+    return retval;
+  if(!test->mode)
+  {
+    seq_puts(s, "mode: none\n");
+    goto exit;
+  }
 
-  /* Allow the device to be autosuspended */
-  if(dev->usb_intf)
-    usb_autopm_put_interface(dev->usb_intf);
+  seq_printf(s, "mode: %s\nstatus: %d\nsize: %u\niterations: %u\nqueue_depth: %u\npattern: %u\nelapsed_us: %llu\n",
+             (test->mode == DRV_TEST_LOOPBACK) ? "loopback" : (test->mode == DRV_TEST_OUT) ? "out" : "in",
+             test->status, test->last.size, test->last.iterations, test->last.queue_depth,
+             test->last.pattern, div_u64(test->elapsed_ns, NSEC_PER_USEC));
+  if(test->mode & DRV_TEST_OUT)
+    drv_test_show_lane(s, "out", &test->lane[DRV_STAT_WRITE], test->elapsed_ns);
+  if(test->mode & DRV_TEST_IN)
+  {
+    drv_test_show_lane(s, "in", &test->lane[DRV_STAT_READ], test->elapsed_ns);
+    seq_printf(s, "in_mismatches: %llu\nfirst_mismatch: %d\n",
+               test->lane[DRV_STAT_READ].mismatches, test->mismatch_offset);
+  }
 
-  /* Decrement usage count for the device */
-  kref_put(&dev->kref, usb_cleanup);
+exit:
+  mutex_unlock(&dev->io_mutex);
   return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(drv_test_result);
 
-static struct file_operations storage_ops = 
+/* Create storage%d under the debugfs directory of the driver */
+static void drv_test_create(struct driver_private *dev)
 {
-  .owner   = THIS_MODULE,
-  .read    = drv_read,
-  .write   = drv_write,
-  .open    = drv_open,
-  .release = drv_release,
-};
+  struct drv_test *test = &dev->test;
+
+  test->params.size = dev->pool_buffer_size;
+  test->params.iterations = 1000;
+  test->params.queue_depth = drv_tune(dev, read_queue_depth);
+  test->params.pattern = DRV_TEST_PATTERN_MOD63;
+
+  test->dir = debugfs_create_dir(dev_name(dev->usb_intf->usb_dev), drv_debugfs_root);
+  debugfs_create_u32("size", 0644, test->dir, &test->params.size);
+  debugfs_create_u32("iterations", 0644, test->dir, &test->params.iterations);
+  debugfs_create_u32("queue_depth", 0644, test->dir, &test->params.queue_depth);
+  debugfs_create_u32("pattern", 0644, test->dir, &test->params.pattern);
+  debugfs_create_file("run", 0200, test->dir, dev, &drv_test_run_fops);
+  debugfs_create_file("result", 0444, test->dir, dev, &drv_test_result_fops);
+}
 
 /* USB Class Driver is initialized to get a minor number from the usb core
    and to have the device register with the usb core */
@@ -341,11 +4973,60 @@ static struct usb_class_driver storage_class =
 #endif
 };
 
+/* Called before the port is reset, quiesces every bulk user. The locks are
+   held until drv_post_reset so that nothing is submitted meanwhile */
+static int drv_pre_reset(struct usb_interface *intf)
+{
+  struct driver_private *dev = usb_get_intfdata(intf);
+
+  if(!dev)
+    return 0;
+  mutex_lock(&dev->io_mutex);
+  mutex_lock(&dev->recover_mutex);
+  mutex_lock(&dev->cmd_mutex);
+  mutex_lock(&dev->ring_mutex);
+
+  /* The read engine and the writes are parked and survive the reset */
+  drv_recover_park_all(dev);
+  /* Asynchronous reads, UAS commands and ring entries fail back to their callers */
+  usb_kill_anchored_urbs(&dev->aio_in_anchor);
+  usb_kill_anchored_urbs(&dev->uas_anchor);
+  if(dev->ring)
+    usb_kill_anchored_urbs(&dev->ring->anchor);
+  return 0;
+}
+
+/* Called once the port is back with its configuration and alternate
+   settings restored, the parked transfers continue where they stopped */
+static int drv_post_reset(struct usb_interface *intf)
+{
+  struct driver_private *dev = usb_get_intfdata(intf);
+  int rebind;
+
+  if(!dev)
+    return 0;
+
+  /* Streams do not survive a reset, such interfaces are probed again and
+     their parked transfers fail in drv_disconnect */
+  rebind = dev->uas || dev->bulk_streams;
+  if(!rebind && !dev->disconnected)
+    drv_recover_resubmit(dev);
+
+  mutex_unlock(&dev->ring_mutex);
+  mutex_unlock(&dev->cmd_mutex);
+  mutex_unlock(&dev->recover_mutex);
+  mutex_unlock(&dev->io_mutex);
+  return rebind;
+}
+
 static int drv_probe(struct usb_interface *intf, const struct usb_device_id *id)
 {
   struct driver_private *dev;
   struct usb_host_interface *iface_desc;
   struct usb_endpoint_descriptor *endpoint;
+  struct drv_bulk_ep *ep;
+  bool bot;
+  int dir;
   int ii;
 
   pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
@@ -357,8 +5038,61 @@ static int drv_probe(struct usb_interface *intf, const struct usb_device_id *id)
     dev_err(&intf->dev, "Memory Allocation Failed\r\n");
     return -ENOMEM;
   }
-  dev->usb_dev  = interface_to_usbdev(intf);
+  /* The structure lives until the last opener and disconnect drop it */
+  kref_init(&dev->kref);
+  dev->usb_dev  = usb_get_dev(interface_to_usbdev(intf));
   dev->usb_intf = intf;
+  /* Small writes are only staged when write_combine is set, usb_cleanup
+     cancels the flush work even when probe fails early */
+  mutex_init(&dev->wc_mutex);
+  INIT_DELAYED_WORK(&dev->wc_work, drv_write_stage_work);
+  mutex_init(&dev->recover_mutex);
+  INIT_DELAYED_WORK(&dev->recover_work, drv_recover_work);
+  spin_lock_init(&dev->sched_lock);
+  INIT_LIST_HEAD(&dev->sched_queue[DRV_STAT_READ]);
+  INIT_LIST_HEAD(&dev->sched_queue[DRV_STAT_WRITE]);
+  init_waitqueue_head(&dev->sched_wait);
+  /* Entries added through new_id without a reference entry carry no profile */
+  dev->profile = id->driver_info ? (const struct drv_profile *)id->driver_info : &drv_profile_generic;
+  dev->stats = alloc_percpu(struct drv_stats);
+  if(!dev->stats)
+  {
+    kref_put(&dev->kref, usb_cleanup);
+    return -ENOMEM;
+  }
+  mutex_init(&dev->io_mutex);
+  mutex_init(&dev->read_mutex);
+  mutex_init(&dev->write_mutex);
+  mutex_init(&dev->ring_mutex);
+  mutex_init(&dev->sg_bounce[DRV_STAT_READ].lock);
+  mutex_init(&dev->sg_bounce[DRV_STAT_WRITE].lock);
+  mutex_init(&dev->cmd_mutex);
+  init_usb_anchor(&dev->uas_anchor);
+  init_completion(&dev->uas_exec_done);
+  init_usb_anchor(&dev->test.anchor);
+  spin_lock_init(&dev->test.lock);
+  init_waitqueue_head(&dev->test.wait);
+
+  /* Pool is filled once the endpoints are known */
+  INIT_LIST_HEAD(&dev->pool_free);
+  spin_lock_init(&dev->pool_lock);
+  init_waitqueue_head(&dev->pool_wait);
+
+  /* Asynchronous reads are anchored apart from the read engine */
+  init_usb_anchor(&dev->aio_in_anchor);
+
+  /* Read engine starts idle, it is armed by the first read */
+  init_usb_anchor(&dev->bulk_in_anchor);
+  INIT_LIST_HEAD(&dev->bulk_in_queue);
+  INIT_LIST_HEAD(&dev->bulk_in_batch);
+  spin_lock_init(&dev->bulk_in_lock);
+  init_waitqueue_head(&dev->bulk_in_wait);
+
+  /* Write path allows write_queue_depth URBs in flight */
+  init_usb_anchor(&dev->bulk_out_anchor);
+  INIT_LIST_HEAD(&dev->bulk_out_queue);
+  sema_init(&dev->bulk_out_limit, max(drv_tune(dev, write_queue_depth), 1U));
+  spin_lock_init(&dev->bulk_out_lock);
   
   /* The currently active alternate setting/interface */
   iface_desc = intf->cur_altsetting;
@@ -368,40 +5102,82 @@ static int drv_probe(struct usb_interface *intf, const struct usb_device_id *id)
   for(ii = 0; ii < iface_desc->desc.bNumEndpoints; ii++)
   {
     /* Copy current interface endpoint descriptor to driver local structure */
-    /* Use only first bulk_in and bulk_out endpoints */
+    /* Every bulk endpoint goes into the table of its direction */
     endpoint = &iface_desc->endpoint[ii].desc;
     
     /* Return true if endpoint has bulk transfer type and IN direction */
-    if(!usb_endpoint_is_bulk_in(endpoint))
-    {
-      /* Get bulk_in endpoint address */
-      dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-      /* Get max packet size */
-      dev->bulk_in_max_size = __le16_to_cpu(endpoint->wMaxPacketSize);
-
-      /* Allocate buffer to receive data from bulk_in endpoint */
-      dev->bulk_in_buffer = kmalloc(dev->bulk_in_max_size, GFP_KERNEL);
-      if(NULL == dev->bulk_in_buffer)
-      {
-        dev_err(&intf->dev, "Could Not Allocate bulk_in_buffer\r\n");
-        kref_put(&dev->kref, usb_cleanup);
-        return -ENOMEM;
-      }
-    }
+    if(usb_endpoint_is_bulk_in(endpoint))
+      dir = DRV_STAT_READ;
     /* Return true if endpoint has bulk transfer type and OUT direction */
-    if(!usb_endpoint_is_bulk_out(endpoint))
-    {
-      /* Get bulk_out endpoint address */
-      dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
-    }
+    else if(usb_endpoint_is_bulk_out(endpoint))
+      dir = DRV_STAT_WRITE;
+    else
+      continue;
+    if(dev->nr_bulk_eps[dir] == DRV_MAX_BULK_EPS)
+      continue;
+
+    ep = &dev->bulk_eps[dir][dev->nr_bulk_eps[dir]++];
+    /* Get endpoint address and max packet size */
+    ep->addr = endpoint->bEndpointAddress;
+    ep->max_size = usb_endpoint_maxp(endpoint);
+    ep->pipe = (dir == DRV_STAT_READ) ? usb_rcvbulkpipe(dev->usb_dev, ep->addr)
+                                      : usb_sndbulkpipe(dev->usb_dev, ep->addr);
+    ep->hep = &iface_desc->endpoint[ii];
   }
   /* Handle when bulk_in or bulk_out endpoints are not found */
-  if(!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr))
+  if(!(dev->nr_bulk_eps[DRV_STAT_READ] && dev->nr_bulk_eps[DRV_STAT_WRITE]))
   {
     dev_err(&intf->dev, "Could Not Find both bulk_in or bulk_out endpoints\r\n");
+    kref_put(&dev->kref, usb_cleanup);
+    return -ENODEV;
+  }
+  /* The first pair serves every path which needs a single pipe */
+  dev->bulk_in_endpointAddr = dev->bulk_eps[DRV_STAT_READ][0].addr;
+  dev->bulk_in_max_size = dev->bulk_eps[DRV_STAT_READ][0].max_size;
+  dev->bulk_out_endpointAddr = dev->bulk_eps[DRV_STAT_WRITE][0].addr;
+  dev->bulk_out_max_size = dev->bulk_eps[DRV_STAT_WRITE][0].max_size;
+
+  /* Bulk-Only speaks over the first pair alone, other interfaces stripe
+     raw transfers over as many complete pairs as they have */
+  bot = iface_desc->desc.bInterfaceClass == USB_CLASS_MASS_STORAGE &&
+        iface_desc->desc.bInterfaceProtocol == USB_PR_BULK;
+  dev->nr_stripes = min(dev->nr_bulk_eps[DRV_STAT_READ], dev->nr_bulk_eps[DRV_STAT_WRITE]);
+  if(stripe_pairs)
+    dev->nr_stripes = min(dev->nr_stripes, stripe_pairs);
+  if(bot)
+    dev->nr_stripes = 1;
+  /* Preallocate every URB and DMA buffer the I/O paths will use */
+  if(drv_pool_create(dev))
+  {
     kref_put(&dev->kref, usb_cleanup);
     return -ENOMEM;
   }
+
+  /* Mass storage interfaces speaking Bulk-Only get the SCSI command engine */
+  if(bot)
+  {
+    dev->bot_cbw = kmalloc(sizeof(*dev->bot_cbw), GFP_KERNEL);
+    dev->bot_csw = kmalloc(sizeof(*dev->bot_csw), GFP_KERNEL);
+    dev->bot_sense = kmalloc(DRV_SENSE_SIZE, GFP_KERNEL);
+    if(!dev->bot_cbw || !dev->bot_csw || !dev->bot_sense)
+    {
+      kref_put(&dev->kref, usb_cleanup);
+      return -ENOMEM;
+    }
+    dev->bot_capable = true;
+
+    /* UAS devices keep Bulk-Only as their first alternate setting, which
+       raw_mode keeps for raw transfers */
+    if(uas_enable && !raw_mode && !(dev->profile->quirks & DRV_QUIRK_NO_UAS))
+      drv_uas_setup(dev);
+  }
+  /* Streams come last, nothing after them fails but the minor below */
+  drv_bulk_streams_setup(dev);
+  /* The block device is optional, the char device works without a medium.
+     It comes before the minor so that no raw transfer can start on the
+     bulk pair it owns, raw_mode leaves the pair to raw transfers */
+  if(dev->bot_capable && !raw_mode && drv_blk_create(dev))
+    dev_warn(&intf->dev, "No block device for this medium\r\n");
   /* Save our private data pointer in interface device */
   usb_set_intfdata(intf, dev);
 
@@ -412,10 +5188,24 @@ static int drv_probe(struct usb_interface *intf, const struct usb_device_id *id)
   {
     dev_err(&intf->dev, "Could Not Get Minor for this device\r\n");
     usb_set_intfdata(intf, NULL);
+    drv_blk_destroy(dev);
+    drv_bulk_streams_free(dev);
+    /* Undo drv_uas_setup, Bulk-Only is back for the next driver */
+    if(dev->uas)
+    {
+      usb_free_streams(intf, dev->uas_stream_eps, 3, GFP_KERNEL);
+      usb_set_interface(dev->usb_dev, intf->cur_altsetting->desc.bInterfaceNumber, 0);
+    }
     kref_put(&dev->kref, usb_cleanup);
     return -EINVAL;
   }
-  dev_info(&intf->dev, "USB Flash Storage Driver is attached to Minor No %d\r\n", intf->minor);
+  dev_info(&intf->dev, "USB Flash Storage Driver is attached to Minor No %d, %s profile\r\n",
+           intf->minor, dev->profile->name);
+  if(dev->nr_stripes > 1)
+    dev_info(&intf->dev, "Raw transfers striped over %u bulk pairs\r\n", dev->nr_stripes);
+
+  /* Self-test files, debugfs failures are not reported by design */
+  drv_test_create(dev);
   return 0;
 }
 
@@ -427,18 +5217,77 @@ static void drv_disconnect(struct usb_interface *intf)
   
   /* Fetch private data pointer from interface device where it was saved */
   dev = usb_get_intfdata(intf);
+  /* Removing the self-test files waits for a running test to finish */
+  debugfs_remove_recursive(dev->test.dir);
   /* Clear the interface device field data */
   usb_set_intfdata(intf, NULL);
-  /* Free Allocated Memory */
-  kref_put(&dev->kref, usb_cleanup);
   /* Free the allocated minor for our device */
   usb_deregister_dev(intf, &storage_class);
+  /* Remove the block device, this waits for the requests it has in flight */
+  drv_blk_destroy(dev);
+
+  /* Prevent more I/O from starting */
+  mutex_lock(&dev->io_mutex);
+  dev->disconnected = true;
+  dev->bulk_in_running = false;
+  mutex_unlock(&dev->io_mutex);
+
+  /* Wake up any reader still waiting, then let the reader holding read_mutex
+     finish so that it cannot post URBs behind the kill below */
+  wake_up_interruptible(&dev->bulk_in_wait);
+  wake_up_all(&dev->sched_wait);
+  mutex_lock(&dev->read_mutex);
+  mutex_unlock(&dev->read_mutex);
+  /* No recovery may run behind the kills below */
+  cancel_delayed_work_sync(&dev->recover_work);
+
+  /* Cancel the read engine */
+  usb_kill_anchored_urbs(&dev->bulk_in_anchor);
+  /* Blocked writers and pollers see the hangup as well */
+  wake_up(&dev->pool_wait);
+  /* Cancel the writes and asynchronous reads still in flight */
+  usb_kill_anchored_urbs(&dev->bulk_out_anchor);
+  usb_kill_anchored_urbs(&dev->aio_in_anchor);
+  /* Transfers parked for the recovery complete with their error */
+  mutex_lock(&dev->recover_mutex);
+  drv_recover_fail(dev);
+  mutex_unlock(&dev->recover_mutex);
+
+  /* Synchronous UAS commands are cut short as well, then the streams go */
+  usb_kill_anchored_urbs(&dev->uas_anchor);
+  if(dev->uas)
+    usb_free_streams(intf, dev->uas_stream_eps, 3, GFP_KERNEL);
+
+  /* Cancel the ring transfers, the ring stays until the last opener is gone */
+  mutex_lock(&dev->ring_mutex);
+  if(dev->ring)
+  {
+    usb_kill_anchored_urbs(&dev->ring->anchor);
+    wake_up_interruptible(&dev->ring->wait);
+  }
+  mutex_unlock(&dev->ring_mutex);
+
+  /* Every bulk URB is gone, the streams can go as well */
+  drv_bulk_streams_free(dev);
+
+  /* Free Allocated Memory */
+  kref_put(&dev->kref, usb_cleanup);
 }
 
-/* Match device and vendor ID and load this driver */
+/* Match device and vendor ID, driver_info selects the profile of the model.
+   More models can be added at runtime through new_id, see commands.txt */
 static struct usb_device_id usb_drv_mtable[] =
 {
-  {USB_DEVICE(VENDOR_ID, DEVICE_ID)},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_CRUZER_BLADE),
+   .driver_info = (kernel_ulong_t)&drv_profile_cruzer_blade},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA),
+   .driver_info = (kernel_ulong_t)&drv_profile_sandisk_ultra},
+  {USB_DEVICE(VENDOR_ID_SANDISK, DEVICE_ID_ULTRA_FIT),
+   .driver_info = (kernel_ulong_t)&drv_profile_sandisk_ultra},
+  {USB_DEVICE(VENDOR_ID_KINGSTON, DEVICE_ID_DT_30),
+   .driver_info = (kernel_ulong_t)&drv_profile_kingston_dt30},
+  {USB_DEVICE(VENDOR_ID_SAMSUNG, DEVICE_ID_BAR_PLUS),
+   .driver_info = (kernel_ulong_t)&drv_profile_samsung_bar},
   {}
 };
 
@@ -448,7 +5297,13 @@ static struct usb_driver usb_drv =
   .name       = "usb_flash_storage_driver",
   .probe      = drv_probe,
   .disconnect = drv_disconnect,
+  .pre_reset  = drv_pre_reset,
+  .post_reset = drv_post_reset,
   .id_table   = usb_drv_mtable,
+  /* Statistics attributes of the interface */
+  .dev_groups = drv_groups,
+  /* Devices enumerating together are probed in parallel */
+  .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init usb_drv_init(void)
@@ -456,8 +5311,12 @@ static int __init usb_drv_init(void)
   int ret;
 
   pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
+  /* Devices add their self-test directories under this one */
+  drv_debugfs_root = debugfs_create_dir("usb_flash_storage", usb_debug_root);
   /* Registers a USB Flash Storage Driver with the USB Core */
   ret = usb_register(&usb_drv);
+  if(ret)
+    debugfs_remove_recursive(drv_debugfs_root);
   return ret;
 }
 
@@ -466,6 +5325,7 @@ static void __exit usb_drv_exit(void)
   pr_info("USB Flash Storage Driver : %s Invoked\r\n", __func__);
   /* Deregister USB Flash Storage Driver from the USB Core */
   usb_deregister(&usb_drv);
+  debugfs_remove_recursive(drv_debugfs_root);
 }
 
 module_init(usb_drv_init);
@@ -0,0 +1,187 @@
+/* Interface shared by the USB Flash Storage Driver and its user applications */
+#ifndef USB_FLASH_DRV_H
+#define USB_FLASH_DRV_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Magic number of the storage%d ioctls */
+#define STORAGE_IOC_MAGIC 'S'
+
+/* mmap offsets of the two regions of a transfer ring */
+/* Queues hold the header followed by the submission and completion entries */
+#define STORAGE_RING_OFF_QUEUES  0x00000000ULL
+/* Buffers hold nr_buffers transfer buffers of buffer_size bytes each */
+#define STORAGE_RING_OFF_BUFFERS 0x10000000ULL
+
+/* Operations accepted in a submission queue entry */
+#define STORAGE_OP_READ  1
+#define STORAGE_OP_WRITE 2
+
+/* Parameters of STORAGE_IOC_RING_SETUP */
+struct storage_ring_params
+{
+  /* In  : No of submission and completion queue entries, a power of 2 */
+  __u32 nr_entries;
+  /* In  : No of transfer buffers, at most nr_entries */
+  __u32 nr_buffers;
+  /* In  : Size of each transfer buffer, rounded up to a page by the driver */
+  __u32 buffer_size;
+  /* Out : Offset of the submission queue entries in the queues region */
+  __u32 sq_off;
+  /* Out : Offset of the completion queue entries in the queues region */
+  __u32 cq_off;
+  __u32 resv;
+  /* Out : Bytes to mmap at STORAGE_RING_OFF_QUEUES */
+  __u64 queues_size;
+  /* Out : Bytes to mmap at STORAGE_RING_OFF_BUFFERS */
+  __u64 buffers_size;
+};
+
+/* Header at the start of the queues region */
+struct storage_ring_hdr
+{
+  /* Next submission entry the driver consumes, written by the driver */
+  __u32 sq_head;
+  /* Next submission entry the application fills, written by the application */
+  __u32 sq_tail;
+  /* Next completion entry the application reaps, written by the application */
+  __u32 cq_head;
+  /* Next completion entry the driver posts, written by the driver */
+  __u32 cq_tail;
+  /* No of entries of each queue, heads and tails wrap with nr_entries - 1 */
+  __u32 nr_entries;
+  __u32 resv[3];
+};
+
+/* Submission queue entry, one bulk transfer from or into a ring buffer */
+struct storage_sqe
+{
+  /* Copied untouched into the completion entry */
+  __u64 user_data;
+  /* STORAGE_OP_READ or STORAGE_OP_WRITE */
+  __u8  opcode;
+  __u8  resv[3];
+  /* Index of the transfer buffer */
+  __u32 buf_index;
+  /* No of bytes to transfer, at most buffer_size */
+  __u32 len;
+  __u32 resv2;
+};
+
+/* Completion queue entry */
+struct storage_cqe
+{
+  /* user_data of the submission entry */
+  __u64 user_data;
+  /* No of bytes transferred or a negative errno */
+  __s32 res;
+  /* Index of the transfer buffer, free for reuse once reaped */
+  __u32 buf_index;
+};
+
+/* Parameters of STORAGE_IOC_RING_ENTER */
+struct storage_ring_enter
+{
+  /* No of new submission entries to consume */
+  __u32 to_submit;
+  /* No of unreaped completions to wait for before returning */
+  __u32 min_complete;
+};
+
+/* Data phase direction of a SCSI command */
+#define STORAGE_DIR_NONE 0
+#define STORAGE_DIR_IN   1
+#define STORAGE_DIR_OUT  2
+
+/* Status of a SCSI command, as reported in the Command Status Wrapper */
+#define STORAGE_STATUS_GOOD   0
+#define STORAGE_STATUS_FAILED 1
+#define STORAGE_STATUS_PHASE  2
+
+/* Flags of a SCSI batch */
+/* Stop at the first command with a transport error or a non good status */
+#define STORAGE_BATCH_STOP_ON_ERROR 0x1
+
+/* One SCSI command of STORAGE_IOC_SCSI_BATCH, e.g. READ(10)/WRITE(10)/READ(16) */
+struct storage_scsi_cmd
+{
+  /* In  : Command descriptor block */
+  __u8  cdb[16];
+  /* In  : Length of the CDB, 1 to 16 */
+  __u8  cdb_len;
+  /* In  : STORAGE_DIR_NONE, STORAGE_DIR_IN or STORAGE_DIR_OUT */
+  __u8  dir;
+  /* In  : Logical unit the command is addressed to */
+  __u8  lun;
+  /* Out : STORAGE_STATUS_* from the Command Status Wrapper */
+  __u8  status;
+  /* In  : Timeout of each transport phase in ms, 0 for the default */
+  __u32 timeout_ms;
+  /* In  : User buffer of the data phase */
+  __u64 data;
+  /* In  : Length of the data phase, 0 for no data */
+  __u32 data_len;
+  /* Out : Bytes of the data phase the device did not process */
+  __u32 residue;
+  /* In  : User buffer receiving sense data when the command fails */
+  __u64 sense;
+  /* In  : Size of the sense buffer, 0 disables automatic REQUEST SENSE */
+  __u8  sense_len;
+  /* Out : No of sense bytes written */
+  __u8  sense_written;
+  __u8  resv[2];
+  /* Out : 0 or a negative errno when the transport itself failed */
+  __s32 result;
+};
+
+/* Parameters of STORAGE_IOC_SCSI_BATCH */
+struct storage_scsi_batch
+{
+  /* In  : Array of struct storage_scsi_cmd */
+  __u64 cmds;
+  /* In  : No of commands in the array */
+  __u32 nr_cmds;
+  /* In  : STORAGE_BATCH_* flags */
+  __u32 flags;
+  /* Out : No of commands executed */
+  __u32 nr_done;
+  __u32 resv;
+};
+
+/* Scheduling classes of a file handle */
+/* Takes turns with the other best effort handles in proportion to its weight */
+#define STORAGE_QOS_CLASS_BE 0
+/* Goes ahead of every best effort handle, needs CAP_SYS_NICE */
+#define STORAGE_QOS_CLASS_RT 1
+
+/* Parameters of STORAGE_IOC_SET_QOS and STORAGE_IOC_GET_QOS, they apply
+   to the raw reads and writes of the handle they are set on */
+struct storage_qos
+{
+  /* STORAGE_QOS_CLASS_BE or STORAGE_QOS_CLASS_RT */
+  __u32 prio_class;
+  /* Share against the other handles of the class, 1 to 1000, 0 for 100 */
+  __u32 weight;
+  /* Largest no of bytes per second, 0 for no cap */
+  __u64 rate_bps;
+  /* Largest no of read and write calls per second, 0 for no cap */
+  __u32 iops;
+  __u32 resv;
+};
+
+/* Allocate the ring of the device, then mmap both regions */
+#define STORAGE_IOC_RING_SETUP    _IOWR(STORAGE_IOC_MAGIC, 1, struct storage_ring_params)
+/* Consume submission entries and optionally wait, returns the no consumed */
+#define STORAGE_IOC_RING_ENTER    _IOW(STORAGE_IOC_MAGIC, 2, struct storage_ring_enter)
+/* Release the ring, both regions must be unmapped */
+#define STORAGE_IOC_RING_TEARDOWN _IO(STORAGE_IOC_MAGIC, 3)
+/* Run SCSI commands over the Bulk-Only Transport, raw reads are stopped
+   and raw writes drained first since they share the bulk endpoints */
+#define STORAGE_IOC_SCSI_BATCH    _IOWR(STORAGE_IOC_MAGIC, 4, struct storage_scsi_batch)
+/* Set the scheduling class, weight and caps of the calling handle */
+#define STORAGE_IOC_SET_QOS       _IOW(STORAGE_IOC_MAGIC, 5, struct storage_qos)
+/* Get the scheduling class, weight and caps of the calling handle */
+#define STORAGE_IOC_GET_QOS       _IOR(STORAGE_IOC_MAGIC, 6, struct storage_qos)
+
+#endif
@@ -0,0 +1,108 @@
+/* Tracepoints of the USB Flash Storage Driver */
+/* Path --> /sys/kernel/tracing/events/usbflash */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbflash
+
+#if !defined(USB_FLASH_DRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define USB_FLASH_DRV_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+/* One URB of a storage%d device, req_id ties the events of one URB together */
+DECLARE_EVENT_CLASS(usbflash_urb,
+
+  TP_PROTO(int minor, struct urb *urb, int status, u64 req_id),
+
+  TP_ARGS(minor, urb, status, req_id),
+
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u8,  ep)
+    __field(u32, len)
+    __field(u32, actual)
+    __field(int, status)
+    __field(u64, req_id)
+  ),
+
+  TP_fast_assign(
+    __entry->minor  = minor;
+    __entry->ep     = usb_pipeendpoint(urb->pipe) | (usb_pipein(urb->pipe) ? USB_DIR_IN : USB_DIR_OUT);
+    __entry->len    = urb->transfer_buffer_length;
+    __entry->actual = urb->actual_length;
+    __entry->status = status;
+    __entry->req_id = req_id;
+  ),
+
+  TP_printk("storage%d ep=0x%02x req=%llu len=%u actual=%u status=%d",
+            __entry->minor, __entry->ep, __entry->req_id,
+            __entry->len, __entry->actual, __entry->status)
+);
+
+/* Right before usb_submit_urb() */
+DEFINE_EVENT(usbflash_urb, usbflash_urb_submit,
+  TP_PROTO(int minor, struct urb *urb, int status, u64 req_id),
+  TP_ARGS(minor, urb, status, req_id)
+);
+
+/* Completed without error */
+DEFINE_EVENT(usbflash_urb, usbflash_urb_complete,
+  TP_PROTO(int minor, struct urb *urb, int status, u64 req_id),
+  TP_ARGS(minor, urb, status, req_id)
+);
+
+/* Killed or unlinked, by an engine stop, a timeout or disconnect */
+DEFINE_EVENT(usbflash_urb, usbflash_urb_cancel,
+  TP_PROTO(int minor, struct urb *urb, int status, u64 req_id),
+  TP_ARGS(minor, urb, status, req_id)
+);
+
+/* Refused by usb_submit_urb() or completed with an error */
+DEFINE_EVENT(usbflash_urb, usbflash_urb_error,
+  TP_PROTO(int minor, struct urb *urb, int status, u64 req_id),
+  TP_ARGS(minor, urb, status, req_id)
+);
+
+/* Entry of a read or write call on storage%d */
+DECLARE_EVENT_CLASS(usbflash_io,
+
+  TP_PROTO(int minor, size_t count, bool nonblock, bool async),
+
+  TP_ARGS(minor, count, nonblock, async),
+
+  TP_STRUCT__entry(
+    __field(int,    minor)
+    __field(size_t, count)
+    __field(bool,   nonblock)
+    __field(bool,   async)
+  ),
+
+  TP_fast_assign(
+    __entry->minor    = minor;
+    __entry->count    = count;
+    __entry->nonblock = nonblock;
+    __entry->async    = async;
+  ),
+
+  TP_printk("storage%d count=%zu nonblock=%d async=%d",
+            __entry->minor, __entry->count, __entry->nonblock, __entry->async)
+);
+
+DEFINE_EVENT(usbflash_io, usbflash_read,
+  TP_PROTO(int minor, size_t count, bool nonblock, bool async),
+  TP_ARGS(minor, count, nonblock, async)
+);
+
+DEFINE_EVENT(usbflash_io, usbflash_write,
+  TP_PROTO(int minor, size_t count, bool nonblock, bool async),
+  TP_ARGS(minor, count, nonblock, async)
+);
+
+#endif /* USB_FLASH_DRV_TRACE_H */
+
+/* The header is outside include/trace/events, tell define_trace.h where it is */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbFlashDrv_trace
+#include <trace/define_trace.h>
@@ -1,30 +1,600 @@
+/* Throughput and latency benchmark for the USB Flash Storage Driver */
+/* Works on the char device /dev/storageN as well as the disk /dev/usbflashN */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
 
-#define MAX 100
+/* Latency histogram, each power of 2 of ns is split into 16 linear sub buckets */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
 
-int main(void)
+/* Largest queue depth of one thread */
+#define MAX_QUEUE_DEPTH 256
+
+enum pattern
+{
+  PATTERN_READ,
+  PATTERN_WRITE,
+  PATTERN_RANDREAD,
+  PATTERN_RANDWRITE,
+  PATTERN_MIXED,
+};
+
+static const char *pattern_names[] =
+{
+  [PATTERN_READ]      = "read",
+  [PATTERN_WRITE]     = "write",
+  [PATTERN_RANDREAD]  = "randread",
+  [PATTERN_RANDWRITE] = "randwrite",
+  [PATTERN_MIXED]     = "mixed",
+};
+
+/* Benchmark settings */
+struct config
+{
+  const char *device;
+  size_t block_size;
+  unsigned int queue_depth;
+  enum pattern pattern;
+  unsigned int read_percent;
+  unsigned int duration;
+  unsigned int threads;
+  bool direct;
+  bool json;
+  /* Bytes addressed by the offsets, 0 for a device without a size */
+  uint64_t span;
+};
+
+/* Results of one direction */
+struct result
+{
+  uint64_t ios;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t hist[HIST_BUCKETS];
+};
+
+/* State of one worker thread */
+struct worker
+{
+  pthread_t thread;
+  unsigned int id;
+  const struct config *cfg;
+  int fd;
+  uint64_t seq_offset;
+  uint64_t rand_state;
+  struct result res[2];
+};
+
+static volatile bool stop;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough to spread offsets and mix reads with writes */
+static uint64_t next_rand(uint64_t *state)
 {
-  int fd, ret;
-  char wrbuff[MAX] = "The Eagle Has Landed";
-  char rdbuff[MAX] = {0};
+  uint64_t x = *state;
 
-  fd = open("/dev/storage0", O_RDWR);
-  if(fd < 0)
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+  unsigned int msb;
+
+  if(ns < HIST_SUB)
+    return ns;
+  msb = 63 - __builtin_clzll(ns);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lower bound of a bucket in ns */
+static uint64_t hist_value(unsigned int bucket)
+{
+  unsigned int major = bucket / HIST_SUB;
+  unsigned int minor = bucket % HIST_SUB;
+
+  if(!major)
+    return minor;
+  return (uint64_t)(HIST_SUB + minor) << (major - 1);
+}
+
+static uint64_t hist_percentile(const struct result *res, double pct)
+{
+  uint64_t target = (uint64_t)(res->ios * pct / 100.0);
+  uint64_t seen = 0;
+  unsigned int ii;
+
+  if(!res->ios)
+    return 0;
+  for(ii = 0; ii < HIST_BUCKETS; ii++)
   {
-    printf("Open failed with %d\n",fd);
-    return fd;
+    seen += res->hist[ii];
+    if(seen > target)
+      return hist_value(ii);
   }
+  return hist_value(HIST_BUCKETS - 1);
+}
 
-  ret = write(fd, wrbuff, strlen(wrbuff));
+static void record(struct result *res, uint64_t ns, ssize_t ret)
+{
+  if(ret < 0)
+  {
+    res->errors++;
+    return;
+  }
+  res->ios++;
+  res->bytes += ret;
+  res->hist[hist_bucket(ns)]++;
+}
+
+/* Pick the direction and offset of the next I/O */
+static bool next_io(struct worker *w, uint64_t *offset)
+{
+  const struct config *cfg = w->cfg;
+  uint64_t blocks = cfg->span / cfg->block_size;
+  bool is_read;
+  bool random;
+
+  switch(cfg->pattern)
+  {
+  case PATTERN_READ:      is_read = true;  random = false; break;
+  case PATTERN_WRITE:     is_read = false; random = false; break;
+  case PATTERN_RANDREAD:  is_read = true;  random = true;  break;
+  case PATTERN_RANDWRITE: is_read = false; random = true;  break;
+  default:
+    is_read = (next_rand(&w->rand_state) % 100) < cfg->read_percent;
+    random = true;
+    break;
+  }
+
+  if(!blocks)
+  {
+    *offset = 0;
+  }
+  else if(random)
+  {
+    *offset = (next_rand(&w->rand_state) % blocks) * cfg->block_size;
+  }
+  else
+  {
+    *offset = w->seq_offset;
+    w->seq_offset += cfg->block_size;
+    if(w->seq_offset + cfg->block_size > cfg->span)
+      w->seq_offset = 0;
+  }
+  return is_read;
+}
 
-  ret = read(fd, rdbuff, sizeof(rdbuff));
+static void *alloc_buffer(size_t size)
+{
+  void *buf;
 
-  close(fd);
+  /* Page aligned so that O_DIRECT works on the disk */
+  if(posix_memalign(&buf, 4096, size))
+    return NULL;
+  memset(buf, 0xa5, size);
+  return buf;
+}
+
+/* Queue depth 1, plain pread/pwrite */
+static void run_sync(struct worker *w)
+{
+  const struct config *cfg = w->cfg;
+  void *buf = alloc_buffer(cfg->block_size);
+  uint64_t offset, start;
+  ssize_t ret;
+  bool is_read;
+
+  if(!buf)
+    return;
+  while(!stop)
+  {
+    is_read = next_io(w, &offset);
+    start = now_ns();
+    if(is_read)
+      ret = pread(w->fd, buf, cfg->block_size, offset);
+    else
+      ret = pwrite(w->fd, buf, cfg->block_size, offset);
+    record(&w->res[is_read ? 0 : 1], now_ns() - start, ret < 0 ? -errno : ret);
+  }
+  free(buf);
+}
+
+static int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+  return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+  return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+  return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events, struct timespec *timeout)
+{
+  return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/* Queue depth above 1, keep queue_depth kernel AIO requests in flight */
+static void run_aio(struct worker *w)
+{
+  const struct config *cfg = w->cfg;
+  unsigned int qd = cfg->queue_depth;
+  struct iocb iocbs[MAX_QUEUE_DEPTH];
+  struct io_event events[MAX_QUEUE_DEPTH];
+  uint64_t started[MAX_QUEUE_DEPTH];
+  unsigned int free_slots[MAX_QUEUE_DEPTH];
+  void *bufs[MAX_QUEUE_DEPTH];
+  struct timespec timeout = { 0, 100000000 };
+  aio_context_t ctx = 0;
+  unsigned int nr_free = 0;
+  unsigned int inflight = 0;
+  unsigned int ii, slot;
+  uint64_t offset;
+  struct iocb *iocb;
+  int nr;
+
+  memset(bufs, 0, sizeof(bufs));
+  if(io_setup(qd, &ctx) < 0)
+  {
+    perror("io_setup");
+    return;
+  }
+  for(ii = 0; ii < qd; ii++)
+  {
+    bufs[ii] = alloc_buffer(cfg->block_size);
+    if(!bufs[ii])
+      goto exit;
+    free_slots[nr_free++] = ii;
+  }
+
+  while(!stop || inflight)
+  {
+    /* Refill every free slot, a busy driver (EAGAIN) is retried after a reap */
+    while(!stop && nr_free)
+    {
+      slot = free_slots[--nr_free];
+      iocb = &iocbs[slot];
+      memset(iocb, 0, sizeof(*iocb));
+      iocb->aio_data = slot;
+      iocb->aio_fildes = w->fd;
+      iocb->aio_lio_opcode = next_io(w, &offset) ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+      iocb->aio_buf = (uint64_t)(uintptr_t)bufs[slot];
+      iocb->aio_nbytes = cfg->block_size;
+      iocb->aio_offset = offset;
+      started[slot] = now_ns();
+      if(io_submit(ctx, 1, &iocb) != 1)
+      {
+        free_slots[nr_free++] = slot;
+        if(errno != EAGAIN)
+          record(&w->res[iocb->aio_lio_opcode == IOCB_CMD_PREAD ? 0 : 1], 0, -errno);
+        if(!inflight)
+          usleep(100);
+        break;
+      }
+      inflight++;
+    }
+    if(!inflight)
+      continue;
+
+    nr = io_getevents(ctx, 1, inflight, events, &timeout);
+    if(nr < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      perror("io_getevents");
+      break;
+    }
+    for(ii = 0; ii < (unsigned int)nr; ii++)
+    {
+      slot = events[ii].data;
+      record(&w->res[iocbs[slot].aio_lio_opcode == IOCB_CMD_PREAD ? 0 : 1],
+             now_ns() - started[slot], events[ii].res);
+      free_slots[nr_free++] = slot;
+    }
+    inflight -= nr;
+  }
+
+exit:
+  io_destroy(ctx);
+  for(ii = 0; ii < qd; ii++)
+    free(bufs[ii]);
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+
+  if(w->cfg->queue_depth > 1)
+    run_aio(w);
+  else
+    run_sync(w);
+  return NULL;
+}
+
+static int parse_size(const char *str, uint64_t *size)
+{
+  char *end;
+  unsigned long long val = strtoull(str, &end, 0);
+
+  switch(*end)
+  {
+  case 'k': case 'K': val <<= 10; end++; break;
+  case 'm': case 'M': val <<= 20; end++; break;
+  case 'g': case 'G': val <<= 30; end++; break;
+  }
+  if(*end)
+    return -1;
+  *size = val;
   return 0;
 }
 
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -d, --device PATH     device to test (/dev/storage0)\n"
+          "  -b, --bs SIZE         block size, k/m suffixes allowed (4k)\n"
+          "  -q, --qd N            requests in flight per thread, 1 uses pread/pwrite (1)\n"
+          "  -p, --pattern NAME    read, write, randread, randwrite or mixed (read)\n"
+          "  -m, --mix PERCENT     share of reads in the mixed pattern (70)\n"
+          "  -t, --time SECONDS    duration of the run (10)\n"
+          "  -j, --threads N       worker threads, each with its own open (1)\n"
+          "  -s, --span SIZE       bytes addressed by the offsets (device size)\n"
+          "  -D, --direct          open with O_DIRECT\n"
+          "  -J, --json            print the results as JSON\n",
+          prog);
+}
+
+static void print_text(const struct config *cfg, const struct result *res, double secs)
+{
+  static const char *dirs[] = { "read", "write" };
+  int dir;
+
+  printf("%s on %s, bs %zu, qd %u, %u thread(s), %.1f s\n",
+         pattern_names[cfg->pattern], cfg->device, cfg->block_size, cfg->queue_depth, cfg->threads, secs);
+  for(dir = 0; dir < 2; dir++)
+  {
+    if(!res[dir].ios && !res[dir].errors)
+      continue;
+    printf("  %-5s: %10.2f MB/s %10.0f IOPS  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  errors %llu\n",
+           dirs[dir], res[dir].bytes / secs / 1e6, res[dir].ios / secs,
+           hist_percentile(&res[dir], 50.0) / 1e3, hist_percentile(&res[dir], 99.0) / 1e3,
+           hist_percentile(&res[dir], 99.9) / 1e3, (unsigned long long)res[dir].errors);
+  }
+}
+
+static void print_json(const struct config *cfg, const struct result *res, double secs)
+{
+  static const char *dirs[] = { "read", "write" };
+  int dir;
+
+  printf("{\n");
+  printf("  \"device\": \"%s\",\n", cfg->device);
+  printf("  \"pattern\": \"%s\",\n", pattern_names[cfg->pattern]);
+  printf("  \"block_size\": %zu,\n", cfg->block_size);
+  printf("  \"queue_depth\": %u,\n", cfg->queue_depth);
+  printf("  \"threads\": %u,\n", cfg->threads);
+  printf("  \"direct\": %s,\n", cfg->direct ? "true" : "false");
+  printf("  \"runtime_s\": %.3f,\n", secs);
+  for(dir = 0; dir < 2; dir++)
+  {
+    printf("  \"%s\": {\n", dirs[dir]);
+    printf("    \"ios\": %llu,\n", (unsigned long long)res[dir].ios);
+    printf("    \"bytes\": %llu,\n", (unsigned long long)res[dir].bytes);
+    printf("    \"errors\": %llu,\n", (unsigned long long)res[dir].errors);
+    printf("    \"mb_per_s\": %.3f,\n", res[dir].bytes / secs / 1e6);
+    printf("    \"iops\": %.1f,\n", res[dir].ios / secs);
+    printf("    \"lat_p50_ns\": %llu,\n", (unsigned long long)hist_percentile(&res[dir], 50.0));
+    printf("    \"lat_p99_ns\": %llu,\n", (unsigned long long)hist_percentile(&res[dir], 99.0));
+    printf("    \"lat_p999_ns\": %llu\n", (unsigned long long)hist_percentile(&res[dir], 99.9));
+    printf("  }%s\n", dir ? "" : ",");
+  }
+  printf("}\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] =
+  {
+    { "device",  required_argument, NULL, 'd' },
+    { "bs",      required_argument, NULL, 'b' },
+    { "qd",      required_argument, NULL, 'q' },
+    { "pattern", required_argument, NULL, 'p' },
+    { "mix",     required_argument, NULL, 'm' },
+    { "time",    required_argument, NULL, 't' },
+    { "threads", required_argument, NULL, 'j' },
+    { "span",    required_argument, NULL, 's' },
+    { "direct",  no_argument,       NULL, 'D' },
+    { "json",    no_argument,       NULL, 'J' },
+    { "help",    no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+  struct config cfg =
+  {
+    .device       = "/dev/storage0",
+    .block_size   = 4096,
+    .queue_depth  = 1,
+    .pattern      = PATTERN_READ,
+    .read_percent = 70,
+    .duration     = 10,
+    .threads      = 1,
+  };
+  struct result total[2];
+  struct worker *workers;
+  struct stat st;
+  uint64_t size, start;
+  double secs;
+  unsigned int ii, jj;
+  int opt, dir;
+  int ret = 0;
+
+  while((opt = getopt_long(argc, argv, "d:b:q:p:m:t:j:s:DJh", options, NULL)) != -1)
+  {
+    switch(opt)
+    {
+    case 'd':
+      cfg.device = optarg;
+      break;
+    case 'b':
+      if(parse_size(optarg, &size) || !size)
+        goto bad_arg;
+      cfg.block_size = size;
+      break;
+    case 'q':
+      cfg.queue_depth = atoi(optarg);
+      if(!cfg.queue_depth || cfg.queue_depth > MAX_QUEUE_DEPTH)
+        goto bad_arg;
+      break;
+    case 'p':
+      for(ii = 0; ii < sizeof(pattern_names) / sizeof(pattern_names[0]); ii++)
+        if(!strcmp(optarg, pattern_names[ii]))
+          break;
+      if(ii == sizeof(pattern_names) / sizeof(pattern_names[0]))
+        goto bad_arg;
+      cfg.pattern = ii;
+      break;
+    case 'm':
+      cfg.read_percent = atoi(optarg);
+      if(cfg.read_percent > 100)
+        goto bad_arg;
+      break;
+    case 't':
+      cfg.duration = atoi(optarg);
+      if(!cfg.duration)
+        goto bad_arg;
+      break;
+    case 'j':
+      cfg.threads = atoi(optarg);
+      if(!cfg.threads)
+        goto bad_arg;
+      break;
+    case 's':
+      if(parse_size(optarg, &cfg.span))
+        goto bad_arg;
+      break;
+    case 'D':
+      cfg.direct = true;
+      break;
+    case 'J':
+      cfg.json = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  workers = calloc(cfg.threads, sizeof(*workers));
+  if(!workers)
+    return 1;
+  for(ii = 0; ii < cfg.threads; ii++)
+    workers[ii].fd = -1;
+
+  /* Every worker opens the device on its own, just like separate applications */
+  for(ii = 0; ii < cfg.threads; ii++)
+  {
+    workers[ii].id = ii;
+    workers[ii].cfg = &cfg;
+    workers[ii].rand_state = 0x9E3779B97F4A7C15ULL * (ii + 1);
+    workers[ii].fd = open(cfg.device, O_RDWR | (cfg.direct ? O_DIRECT : 0));
+    if(workers[ii].fd < 0)
+    {
+      fprintf(stderr, "Open of %s failed: %s\n", cfg.device, strerror(errno));
+      ret = 1;
+      goto exit;
+    }
+  }
+
+  /* Offsets only matter on the disk, the char device is a stream */
+  if(!cfg.span && !fstat(workers[0].fd, &st) && S_ISBLK(st.st_mode))
+    ioctl(workers[0].fd, BLKGETSIZE64, &cfg.span);
+
+  /* Sequential workers start on separate stretches of the span */
+  for(ii = 0; cfg.span && ii < cfg.threads; ii++)
+    workers[ii].seq_offset = (cfg.span / cfg.threads / cfg.block_size) * cfg.block_size * ii;
+
+  start = now_ns();
+  for(ii = 0; ii < cfg.threads; ii++)
+  {
+    if(pthread_create(&workers[ii].thread, NULL, worker_main, &workers[ii]))
+    {
+      fprintf(stderr, "Could not start worker %u\n", ii);
+      stop = true;
+      cfg.threads = ii;
+      ret = 1;
+      break;
+    }
+  }
+  if(!ret)
+    sleep(cfg.duration);
+  stop = true;
+  for(ii = 0; ii < cfg.threads; ii++)
+    pthread_join(workers[ii].thread, NULL);
+  secs = (now_ns() - start) / 1e9;
+
+  memset(total, 0, sizeof(total));
+  for(ii = 0; ii < cfg.threads; ii++)
+  {
+    for(dir = 0; dir < 2; dir++)
+    {
+      total[dir].ios += workers[ii].res[dir].ios;
+      total[dir].bytes += workers[ii].res[dir].bytes;
+      total[dir].errors += workers[ii].res[dir].errors;
+      for(jj = 0; jj < HIST_BUCKETS; jj++)
+        total[dir].hist[jj] += workers[ii].res[dir].hist[jj];
+    }
+  }
+
+  if(cfg.json)
+    print_json(&cfg, total, secs);
+  else
+    print_text(&cfg, total, secs);
+
+exit:
+  for(ii = 0; ii < cfg.threads; ii++)
+    if(workers[ii].fd >= 0)
+      close(workers[ii].fd);
+  free(workers);
+  return ret;
+
+bad_arg:
+  fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+  usage(argv[0]);
+  return 1;
+}
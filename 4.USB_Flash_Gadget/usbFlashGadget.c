@@ -0,0 +1,827 @@
+/* This gadget function emulates the bulk endpoints of a USB flash drive */
+/* Bound over dummy_hcd it lets the USB Flash Storage Driver run without hardware */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/usb/composite.h>
+
+/* Behaviour of the bulk endpoints */
+/* Data received on bulk_out is sent back on bulk_in, as f_loopback does */
+#define EMU_MODE_LOOPBACK   0
+/* Data received on bulk_out is dropped, bulk_in returns the mod63 pattern */
+#define EMU_MODE_SOURCESINK 1
+
+/* Defaults of the configfs attributes */
+#define EMU_DEFAULT_BUFLEN 16384
+#define EMU_DEFAULT_QLEN   8
+
+/* Attributes of one flashemu.<instance> directory in configfs */
+struct emu_opts
+{
+  struct usb_function_instance func_inst;
+  /* Protects the attributes and refcnt */
+  struct mutex lock;
+  /* No of functions using these options, the layout is frozen while bound */
+  int refcnt;
+
+  /* Layout, taken at bind */
+  /* EMU_MODE_* */
+  unsigned int mode;
+  /* Size of each request buffer */
+  unsigned int buflen;
+  /* No of requests queued on each endpoint */
+  unsigned int qlen;
+
+  /* Timing and error injection, may be changed while bound */
+  /* Throughput of the emulated flash in KB/s, 0 for unlimited */
+  unsigned int bandwidth;
+  /* Time added to every transfer in us */
+  unsigned int latency_us;
+  /* Halt bulk_out on every Nth transfer received, 0 disables */
+  unsigned int stall_every;
+  /* Flip one byte of every Nth transfer sent, 0 disables */
+  unsigned int corrupt_every;
+  /* Throw away every Nth transfer received instead of looping it back, 0 disables */
+  unsigned int drop_every;
+};
+
+struct f_emu;
+
+/* One buffer of the function, with the request of each endpoint using it */
+struct emu_req
+{
+  /* Function owning this buffer */
+  struct f_emu *emu;
+  /* Requests of bulk_out and bulk_in, one of them is NULL in sourcesink mode */
+  struct usb_request *out_req;
+  struct usb_request *in_req;
+  unsigned char *buf;
+  /* Holds a request back for the bandwidth and latency of the flash */
+  struct hrtimer timer;
+  /* Request queued and its endpoint once the timer fires */
+  struct usb_request *next_req;
+  struct usb_ep *next_ep;
+  /* Session the deferred request belongs to, stale ones are dropped */
+  unsigned int gen;
+  /* Offset of the byte flipped in a sourcesink buffer, -1 when intact */
+  int corrupt_offset;
+};
+
+/* Private Structure */
+struct f_emu
+{
+  struct usb_function function;
+  /* Options this function was created from */
+  struct emu_opts *opts;
+  struct usb_ep *in_ep;
+  struct usb_ep *out_ep;
+
+  /* Layout copied from the options at bind */
+  unsigned int mode;
+  unsigned int buflen;
+  /* Buffers and their requests, allocated at bind */
+  struct emu_req *reqs;
+  unsigned int nr_reqs;
+
+  /* Protects running, gen and busy_until against the completion handlers */
+  spinlock_t lock;
+  /* True while the endpoints are enabled */
+  bool running;
+  /* Bumped every time the endpoints go down */
+  unsigned int gen;
+  /* Time the emulated flash is done with the transfers accepted so far */
+  ktime_t busy_until;
+
+  /* No of transfers received and sent, for the error injection */
+  atomic_t out_count;
+  atomic_t in_count;
+};
+
+static inline struct f_emu *func_to_emu(struct usb_function *f)
+{
+  return container_of(f, struct f_emu, function);
+}
+
+static inline struct emu_opts *to_emu_opts(struct config_item *item)
+{
+  return container_of(to_config_group(item), struct emu_opts, func_inst.group);
+}
+
+/* Vendor specific interface with one bulk_in and one bulk_out endpoint */
+static struct usb_interface_descriptor emu_intf =
+{
+  .bLength            = USB_DT_INTERFACE_SIZE,
+  .bDescriptorType    = USB_DT_INTERFACE,
+  .bNumEndpoints      = 2,
+  .bInterfaceClass    = USB_CLASS_VENDOR_SPEC,
+  /* .iInterface      = DYNAMIC */
+};
+
+/* Full speed endpoints */
+static struct usb_endpoint_descriptor emu_fs_in_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bEndpointAddress   = USB_DIR_IN,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+};
+
+static struct usb_endpoint_descriptor emu_fs_out_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bEndpointAddress   = USB_DIR_OUT,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+};
+
+static struct usb_descriptor_header *emu_fs_descs[] =
+{
+  (struct usb_descriptor_header *)&emu_intf,
+  (struct usb_descriptor_header *)&emu_fs_in_desc,
+  (struct usb_descriptor_header *)&emu_fs_out_desc,
+  NULL,
+};
+
+/* High speed endpoints, 512 byte packets as on a USB 2.0 stick */
+static struct usb_endpoint_descriptor emu_hs_in_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize     = cpu_to_le16(512),
+};
+
+static struct usb_endpoint_descriptor emu_hs_out_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize     = cpu_to_le16(512),
+};
+
+static struct usb_descriptor_header *emu_hs_descs[] =
+{
+  (struct usb_descriptor_header *)&emu_intf,
+  (struct usb_descriptor_header *)&emu_hs_in_desc,
+  (struct usb_descriptor_header *)&emu_hs_out_desc,
+  NULL,
+};
+
+/* SuperSpeed endpoints, 1024 byte packets as on a USB 3.0 stick */
+static struct usb_endpoint_descriptor emu_ss_in_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize     = cpu_to_le16(1024),
+};
+
+static struct usb_ss_ep_comp_descriptor emu_ss_in_comp_desc =
+{
+  .bLength            = USB_DT_SS_EP_COMP_SIZE,
+  .bDescriptorType    = USB_DT_SS_ENDPOINT_COMP,
+};
+
+static struct usb_endpoint_descriptor emu_ss_out_desc =
+{
+  .bLength            = USB_DT_ENDPOINT_SIZE,
+  .bDescriptorType    = USB_DT_ENDPOINT,
+  .bmAttributes       = USB_ENDPOINT_XFER_BULK,
+  .wMaxPacketSize     = cpu_to_le16(1024),
+};
+
+static struct usb_ss_ep_comp_descriptor emu_ss_out_comp_desc =
+{
+  .bLength            = USB_DT_SS_EP_COMP_SIZE,
+  .bDescriptorType    = USB_DT_SS_ENDPOINT_COMP,
+};
+
+static struct usb_descriptor_header *emu_ss_descs[] =
+{
+  (struct usb_descriptor_header *)&emu_intf,
+  (struct usb_descriptor_header *)&emu_ss_in_desc,
+  (struct usb_descriptor_header *)&emu_ss_in_comp_desc,
+  (struct usb_descriptor_header *)&emu_ss_out_desc,
+  (struct usb_descriptor_header *)&emu_ss_out_comp_desc,
+  NULL,
+};
+
+static struct usb_string emu_string_defs[] =
+{
+  [0].s = "Flash Drive Emulator",
+  {}
+};
+
+static struct usb_gadget_strings emu_string_table =
+{
+  .language = 0x0409, /* en-us */
+  .strings  = emu_string_defs,
+};
+
+static struct usb_gadget_strings *emu_strings[] =
+{
+  &emu_string_table,
+  NULL,
+};
+
+/* Fill a buffer with the pattern the host self-test checks, restarting with every packet */
+static void emu_fill_pattern(unsigned char *buf, unsigned int len, unsigned int maxpacket)
+{
+  unsigned int ii;
+
+  for(ii = 0; ii < len; ii++)
+    buf[ii] = (ii % maxpacket) % 63;
+}
+
+/* Check whether this is the Nth transfer of an injection, 0 turns it off */
+static bool emu_every(unsigned int count, unsigned int every)
+{
+  return every && !(count % every);
+}
+
+static void emu_queue(struct f_emu *emu, struct usb_ep *ep, struct usb_request *req)
+{
+  int retval;
+
+  retval = usb_ep_queue(ep, req, GFP_ATOMIC);
+  if(retval)
+    ERROR(emu->function.config->cdev, "%s queue req --> %d\n", ep->name, retval);
+}
+
+/* Called when the flash would be done with a deferred transfer */
+static enum hrtimer_restart emu_timer_fn(struct hrtimer *timer)
+{
+  struct emu_req *er = container_of(timer, struct emu_req, timer);
+  struct f_emu *emu = er->emu;
+  unsigned long flags;
+  bool live;
+
+  /* Requests of a session that has been torn down are not queued again */
+  spin_lock_irqsave(&emu->lock, flags);
+  live = emu->running && er->gen == emu->gen;
+  spin_unlock_irqrestore(&emu->lock, flags);
+
+  if(live)
+    emu_queue(emu, er->next_ep, er->next_req);
+  return HRTIMER_NORESTART;
+}
+
+/* Queue a request once the emulated flash has moved len bytes. Transfers
+   share the bandwidth one after the other, the latency overlaps */
+static void emu_defer(struct emu_req *er, struct usb_ep *ep, struct usb_request *req, unsigned int len)
+{
+  struct f_emu *emu = er->emu;
+  unsigned int bandwidth = READ_ONCE(emu->opts->bandwidth);
+  unsigned int latency_us = READ_ONCE(emu->opts->latency_us);
+  ktime_t now = ktime_get();
+  ktime_t release;
+  unsigned long flags;
+
+  if(!bandwidth && !latency_us)
+  {
+    emu_queue(emu, ep, req);
+    return;
+  }
+
+  spin_lock_irqsave(&emu->lock, flags);
+  if(!emu->running)
+  {
+    spin_unlock_irqrestore(&emu->lock, flags);
+    return;
+  }
+  if(ktime_before(emu->busy_until, now))
+    emu->busy_until = now;
+  if(bandwidth)
+    emu->busy_until = ktime_add_ns(emu->busy_until, div_u64((u64)len * NSEC_PER_SEC, bandwidth * 1024ULL));
+  release = ktime_add_us(emu->busy_until, latency_us);
+  er->gen = emu->gen;
+  spin_unlock_irqrestore(&emu->lock, flags);
+
+  er->next_ep = ep;
+  er->next_req = req;
+  hrtimer_start(&er->timer, release, HRTIMER_MODE_ABS_SOFT);
+}
+
+/* Called when a transfer from the host has landed in a buffer */
+static void emu_out_complete(struct usb_ep *ep, struct usb_request *req)
+{
+  struct emu_req *er = req->context;
+  struct f_emu *emu = er->emu;
+  struct emu_opts *opts = emu->opts;
+  unsigned int count;
+
+  switch(req->status)
+  {
+  case 0:
+    break;
+  /* Endpoint disabled or the host went away, the request stays idle */
+  case -ECONNABORTED:
+  case -ECONNRESET:
+  case -ESHUTDOWN:
+    return;
+  default:
+    ERROR(emu->function.config->cdev, "%s complete --> %d, %d/%d\n", ep->name,
+          req->status, req->actual, req->length);
+    emu_queue(emu, ep, req);
+    return;
+  }
+
+  count = atomic_inc_return(&emu->out_count);
+
+  /* The host sees the stall on its next transfer, the request waits for the clear */
+  if(emu_every(count, READ_ONCE(opts->stall_every)))
+  {
+    usb_ep_set_halt(ep);
+    emu_queue(emu, ep, req);
+    return;
+  }
+
+  /* Sinks and dropped transfers only cost the write time of the flash */
+  if(emu->mode == EMU_MODE_SOURCESINK || emu_every(count, READ_ONCE(opts->drop_every)))
+  {
+    emu_defer(er, ep, req, req->actual);
+    return;
+  }
+
+  /* Loop the data back, the host reads exactly what it wrote */
+  er->in_req->length = req->actual;
+  if(req->actual && emu_every(count, READ_ONCE(opts->corrupt_every)))
+    er->buf[req->actual / 2] ^= 0xff;
+  emu_defer(er, emu->in_ep, er->in_req, req->actual);
+}
+
+/* Called when the host has read a buffer */
+static void emu_in_complete(struct usb_ep *ep, struct usb_request *req)
+{
+  struct emu_req *er = req->context;
+  struct f_emu *emu = er->emu;
+  unsigned int count;
+
+  switch(req->status)
+  {
+  case 0:
+    break;
+  case -ECONNABORTED:
+  case -ECONNRESET:
+  case -ESHUTDOWN:
+    return;
+  default:
+    ERROR(emu->function.config->cdev, "%s complete --> %d, %d/%d\n", ep->name,
+          req->status, req->actual, req->length);
+    break;
+  }
+
+  /* The buffer is free for the next transfer from the host */
+  if(emu->mode == EMU_MODE_LOOPBACK)
+  {
+    emu_queue(emu, emu->out_ep, er->out_req);
+    return;
+  }
+
+  /* Sources restore the pattern and pay the read time of the flash */
+  if(er->corrupt_offset >= 0)
+  {
+    er->buf[er->corrupt_offset] ^= 0xff;
+    er->corrupt_offset = -1;
+  }
+  count = atomic_inc_return(&emu->in_count);
+  if(emu_every(count, READ_ONCE(emu->opts->corrupt_every)))
+  {
+    er->corrupt_offset = req->length / 2;
+    er->buf[er->corrupt_offset] ^= 0xff;
+  }
+  emu_defer(er, ep, req, req->length);
+}
+
+/* Disable the endpoints, deferred requests still on a timer are dropped */
+static void emu_stop(struct f_emu *emu)
+{
+  unsigned long flags;
+  unsigned int ii;
+
+  spin_lock_irqsave(&emu->lock, flags);
+  emu->running = false;
+  emu->gen++;
+  spin_unlock_irqrestore(&emu->lock, flags);
+
+  /* A timer already running sees the new session and gives up */
+  for(ii = 0; ii < emu->nr_reqs; ii++)
+    hrtimer_try_to_cancel(&emu->reqs[ii].timer);
+
+  /* Queued requests complete with -ESHUTDOWN */
+  usb_ep_disable(emu->in_ep);
+  usb_ep_disable(emu->out_ep);
+}
+
+/* Enable the endpoints for the current speed and queue every buffer */
+static int emu_start(struct f_emu *emu, struct usb_composite_dev *cdev)
+{
+  struct emu_req *er;
+  unsigned int maxpacket;
+  unsigned long flags;
+  unsigned int ii;
+  int retval;
+
+  retval = config_ep_by_speed(cdev->gadget, &emu->function, emu->in_ep);
+  if(retval)
+    return retval;
+  retval = usb_ep_enable(emu->in_ep);
+  if(retval)
+    return retval;
+  retval = config_ep_by_speed(cdev->gadget, &emu->function, emu->out_ep);
+  if(!retval)
+    retval = usb_ep_enable(emu->out_ep);
+  if(retval)
+  {
+    usb_ep_disable(emu->in_ep);
+    return retval;
+  }
+
+  spin_lock_irqsave(&emu->lock, flags);
+  emu->running = true;
+  emu->busy_until = ktime_get();
+  spin_unlock_irqrestore(&emu->lock, flags);
+  atomic_set(&emu->out_count, 0);
+  atomic_set(&emu->in_count, 0);
+
+  /* The pattern restarts with every packet, whose size depends on the speed */
+  maxpacket = usb_endpoint_maxp(emu->in_ep->desc);
+  for(ii = 0; ii < emu->nr_reqs; ii++)
+  {
+    er = &emu->reqs[ii];
+    if(er->out_req)
+    {
+      er->out_req->length = emu->buflen;
+      emu_queue(emu, emu->out_ep, er->out_req);
+    }
+    else
+    {
+      emu_fill_pattern(er->buf, emu->buflen, maxpacket);
+      er->corrupt_offset = -1;
+      er->in_req->length = emu->buflen;
+      emu_queue(emu, emu->in_ep, er->in_req);
+    }
+  }
+  return 0;
+}
+
+static int emu_set_alt(struct usb_function *f, unsigned int intf, unsigned int alt)
+{
+  struct f_emu *emu = func_to_emu(f);
+  struct usb_composite_dev *cdev = f->config->cdev;
+
+  /* Only one alternate setting, restart it on every SET_INTERFACE */
+  if(emu->running)
+    emu_stop(emu);
+  return emu_start(emu, cdev);
+}
+
+static void emu_disable(struct usb_function *f)
+{
+  struct f_emu *emu = func_to_emu(f);
+
+  if(emu->running)
+    emu_stop(emu);
+}
+
+/* Release the buffers and their requests, none may be queued */
+static void emu_free_reqs(struct f_emu *emu)
+{
+  struct emu_req *er;
+  unsigned int ii;
+
+  for(ii = 0; ii < emu->nr_reqs; ii++)
+  {
+    er = &emu->reqs[ii];
+    hrtimer_cancel(&er->timer);
+    if(er->out_req)
+      usb_ep_free_request(emu->out_ep, er->out_req);
+    if(er->in_req)
+      usb_ep_free_request(emu->in_ep, er->in_req);
+    kfree(er->buf);
+  }
+  kfree(emu->reqs);
+  emu->reqs = NULL;
+  emu->nr_reqs = 0;
+}
+
+/* Allocate qlen buffers, each with a request on both endpoints in loopback mode,
+   or qlen buffers on each endpoint in sourcesink mode */
+static int emu_alloc_reqs(struct f_emu *emu, unsigned int qlen)
+{
+  unsigned int nr = (emu->mode == EMU_MODE_LOOPBACK) ? qlen : 2 * qlen;
+  struct emu_req *er;
+  unsigned int ii;
+
+  emu->reqs = kcalloc(nr, sizeof(*emu->reqs), GFP_KERNEL);
+  if(!emu->reqs)
+    return -ENOMEM;
+
+  for(ii = 0; ii < nr; ii++)
+  {
+    er = &emu->reqs[ii];
+    er->emu = emu;
+    hrtimer_init(&er->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    er->timer.function = emu_timer_fn;
+    emu->nr_reqs++;
+
+    er->buf = kmalloc(emu->buflen, GFP_KERNEL);
+    if(!er->buf)
+      goto error;
+
+    /* Sourcesink takes the first half on bulk_out and the second on bulk_in */
+    if(emu->mode == EMU_MODE_LOOPBACK || ii < qlen)
+    {
+      er->out_req = usb_ep_alloc_request(emu->out_ep, GFP_KERNEL);
+      if(!er->out_req)
+        goto error;
+      er->out_req->buf = er->buf;
+      er->out_req->complete = emu_out_complete;
+      er->out_req->context = er;
+    }
+    if(emu->mode == EMU_MODE_LOOPBACK || ii >= qlen)
+    {
+      er->in_req = usb_ep_alloc_request(emu->in_ep, GFP_KERNEL);
+      if(!er->in_req)
+        goto error;
+      er->in_req->buf = er->buf;
+      er->in_req->complete = emu_in_complete;
+      er->in_req->context = er;
+    }
+  }
+  return 0;
+
+error:
+  emu_free_reqs(emu);
+  return -ENOMEM;
+}
+
+static int emu_bind(struct usb_configuration *c, struct usb_function *f)
+{
+  struct usb_composite_dev *cdev = c->cdev;
+  struct f_emu *emu = func_to_emu(f);
+  struct usb_string *us;
+  int id;
+  int retval;
+
+  pr_info("USB Flash Gadget : %s Invoked\r\n", __func__);
+
+  /* Allocate interface ID */
+  id = usb_interface_id(c, f);
+  if(id < 0)
+    return id;
+  emu_intf.bInterfaceNumber = id;
+
+  us = usb_gstrings_attach(cdev, emu_strings, ARRAY_SIZE(emu_string_defs));
+  if(IS_ERR(us))
+    return PTR_ERR(us);
+  emu_intf.iInterface = us[0].id;
+
+  /* Allocate endpoints */
+  emu->in_ep = usb_ep_autoconfig(cdev->gadget, &emu_fs_in_desc);
+  if(!emu->in_ep)
+    goto autoconf_fail;
+  emu->out_ep = usb_ep_autoconfig(cdev->gadget, &emu_fs_out_desc);
+  if(!emu->out_ep)
+    goto autoconf_fail;
+
+  /* Support high speed and SuperSpeed hardware, same endpoint addresses */
+  emu_hs_in_desc.bEndpointAddress = emu_fs_in_desc.bEndpointAddress;
+  emu_hs_out_desc.bEndpointAddress = emu_fs_out_desc.bEndpointAddress;
+  emu_ss_in_desc.bEndpointAddress = emu_fs_in_desc.bEndpointAddress;
+  emu_ss_out_desc.bEndpointAddress = emu_fs_out_desc.bEndpointAddress;
+
+  retval = usb_assign_descriptors(f, emu_fs_descs, emu_hs_descs, emu_ss_descs, emu_ss_descs);
+  if(retval)
+    return retval;
+
+  /* Layout of the buffers is frozen from here on */
+  mutex_lock(&emu->opts->lock);
+  emu->mode = emu->opts->mode;
+  emu->buflen = emu->opts->buflen;
+  retval = emu_alloc_reqs(emu, emu->opts->qlen);
+  mutex_unlock(&emu->opts->lock);
+  if(retval)
+  {
+    usb_free_all_descriptors(f);
+    return retval;
+  }
+
+  DBG(cdev, "%s speed %s: IN/%s, OUT/%s\n",
+      gadget_is_superspeed(c->cdev->gadget) ? "super" :
+      (gadget_is_dualspeed(c->cdev->gadget) ? "dual" : "full"),
+      f->name, emu->in_ep->name, emu->out_ep->name);
+  return 0;
+
+autoconf_fail:
+  ERROR(cdev, "%s: can't autoconfigure on %s\n", f->name, cdev->gadget->name);
+  return -ENODEV;
+}
+
+static void emu_unbind(struct usb_configuration *c, struct usb_function *f)
+{
+  struct f_emu *emu = func_to_emu(f);
+
+  pr_info("USB Flash Gadget : %s Invoked\r\n", __func__);
+  emu_free_reqs(emu);
+  usb_free_all_descriptors(f);
+}
+
+static void emu_free_func(struct usb_function *f)
+{
+  struct f_emu *emu = func_to_emu(f);
+
+  mutex_lock(&emu->opts->lock);
+  emu->opts->refcnt--;
+  mutex_unlock(&emu->opts->lock);
+  kfree(emu);
+}
+
+static struct usb_function *emu_alloc_func(struct usb_function_instance *fi)
+{
+  struct emu_opts *opts = container_of(fi, struct emu_opts, func_inst);
+  struct f_emu *emu;
+
+  emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+  if(!emu)
+    return ERR_PTR(-ENOMEM);
+
+  mutex_lock(&opts->lock);
+  opts->refcnt++;
+  mutex_unlock(&opts->lock);
+
+  emu->opts = opts;
+  spin_lock_init(&emu->lock);
+  emu->function.name    = "flashemu";
+  emu->function.bind    = emu_bind;
+  emu->function.unbind  = emu_unbind;
+  emu->function.set_alt = emu_set_alt;
+  emu->function.disable = emu_disable;
+  emu->function.free_func = emu_free_func;
+  return &emu->function;
+}
+
+static void emu_attr_release(struct config_item *item)
+{
+  struct emu_opts *opts = to_emu_opts(item);
+
+  usb_put_function_instance(&opts->func_inst);
+}
+
+static struct configfs_item_operations emu_item_ops =
+{
+  .release = emu_attr_release,
+};
+
+/* Numeric attribute, _frozen ones cannot change while the function is bound */
+#define EMU_ATTR(_name, _frozen, _min)                                                       \
+static ssize_t emu_opts_##_name##_show(struct config_item *item, char *page)                  \
+{                                                                                             \
+  struct emu_opts *opts = to_emu_opts(item);                                                  \
+  int retval;                                                                                 \
+                                                                                              \
+  mutex_lock(&opts->lock);                                                                    \
+  retval = sprintf(page, "%u\n", opts->_name);                                                \
+  mutex_unlock(&opts->lock);                                                                  \
+  return retval;                                                                              \
+}                                                                                             \
+                                                                                              \
+static ssize_t emu_opts_##_name##_store(struct config_item *item, const char *page, size_t len) \
+{                                                                                             \
+  struct emu_opts *opts = to_emu_opts(item);                                                  \
+  unsigned int num;                                                                           \
+  int retval;                                                                                 \
+                                                                                              \
+  retval = kstrtouint(page, 0, &num);                                                         \
+  if(retval)                                                                                  \
+    return retval;                                                                            \
+  if(num < (_min))                                                                            \
+    return -EINVAL;                                                                           \
+                                                                                              \
+  mutex_lock(&opts->lock);                                                                    \
+  if((_frozen) && opts->refcnt)                                                               \
+    retval = -EBUSY;                                                                          \
+  else                                                                                        \
+    WRITE_ONCE(opts->_name, num);                                                             \
+  mutex_unlock(&opts->lock);                                                                  \
+  return retval ? retval : len;                                                               \
+}                                                                                             \
+                                                                                              \
+CONFIGFS_ATTR(emu_opts_, _name)
+
+EMU_ATTR(buflen, true, 1);
+EMU_ATTR(qlen, true, 1);
+EMU_ATTR(bandwidth, false, 0);
+EMU_ATTR(latency_us, false, 0);
+EMU_ATTR(stall_every, false, 0);
+EMU_ATTR(corrupt_every, false, 0);
+EMU_ATTR(drop_every, false, 0);
+
+/* Mode is shown and set by name, loopback or sourcesink */
+static ssize_t emu_opts_mode_show(struct config_item *item, char *page)
+{
+  struct emu_opts *opts = to_emu_opts(item);
+  int retval;
+
+  mutex_lock(&opts->lock);
+  retval = sprintf(page, "%s\n", (opts->mode == EMU_MODE_LOOPBACK) ? "loopback" : "sourcesink");
+  mutex_unlock(&opts->lock);
+  return retval;
+}
+
+static ssize_t emu_opts_mode_store(struct config_item *item, const char *page, size_t len)
+{
+  struct emu_opts *opts = to_emu_opts(item);
+  unsigned int mode;
+  int retval = len;
+
+  if(sysfs_streq(page, "loopback"))
+    mode = EMU_MODE_LOOPBACK;
+  else if(sysfs_streq(page, "sourcesink"))
+    mode = EMU_MODE_SOURCESINK;
+  else
+    return -EINVAL;
+
+  mutex_lock(&opts->lock);
+  if(opts->refcnt)
+    retval = -EBUSY;
+  else
+    opts->mode = mode;
+  mutex_unlock(&opts->lock);
+  return retval;
+}
+
+CONFIGFS_ATTR(emu_opts_, mode);
+
+static struct configfs_attribute *emu_attrs[] =
+{
+  &emu_opts_attr_mode,
+  &emu_opts_attr_buflen,
+  &emu_opts_attr_qlen,
+  &emu_opts_attr_bandwidth,
+  &emu_opts_attr_latency_us,
+  &emu_opts_attr_stall_every,
+  &emu_opts_attr_corrupt_every,
+  &emu_opts_attr_drop_every,
+  NULL,
+};
+
+static const struct config_item_type emu_func_type =
+{
+  .ct_item_ops = &emu_item_ops,
+  .ct_attrs    = emu_attrs,
+  .ct_owner    = THIS_MODULE,
+};
+
+static void emu_free_instance(struct usb_function_instance *fi)
+{
+  struct emu_opts *opts = container_of(fi, struct emu_opts, func_inst);
+
+  kfree(opts);
+}
+
+static struct usb_function_instance *emu_alloc_instance(void)
+{
+  struct emu_opts *opts;
+
+  opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+  if(!opts)
+    return ERR_PTR(-ENOMEM);
+  mutex_init(&opts->lock);
+  opts->func_inst.free_func_inst = emu_free_instance;
+  opts->mode   = EMU_MODE_LOOPBACK;
+  opts->buflen = EMU_DEFAULT_BUFLEN;
+  opts->qlen   = EMU_DEFAULT_QLEN;
+
+  config_group_init_type_name(&opts->func_inst.group, "", &emu_func_type);
+  return &opts->func_inst;
+}
+
+/* Registered as functions/flashemu.<instance> in configfs */
+DECLARE_USB_FUNCTION(flashemu, emu_alloc_instance, emu_alloc_func);
+
+static int __init usb_emu_init(void)
+{
+  pr_info("USB Flash Gadget : %s Invoked\r\n", __func__);
+  /* Registers the function with the composite framework */
+  return usb_function_register(&flashemuusb_func);
+}
+
+static void __exit usb_emu_exit(void)
+{
+  pr_info("USB Flash Gadget : %s Invoked\r\n", __func__);
+  usb_function_unregister(&flashemuusb_func);
+}
+
+module_init(usb_emu_init);
+module_exit(usb_emu_exit);
+
+MODULE_AUTHOR("debmalyasarkar1@gmail.com");
+MODULE_DESCRIPTION("USB Flash Drive Emulator Gadget Function");
+MODULE_LICENSE("GPL");